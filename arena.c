@@ -0,0 +1,88 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Chunk headers are padded so chunk data keeps ARENA_ALIGNMENT. */
+#define CHUNK_HEADER_SIZE \
+  ((sizeof(struct arena_chunk) + ARENA_ALIGNMENT - 1) \
+   & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static void push_chunk(struct arena *arena, size_t size) {
+  struct arena_chunk *chunk = NULL;
+  if (posix_memalign((void**)&chunk, ARENA_ALIGNMENT,
+                     CHUNK_HEADER_SIZE + size) != 0) {
+    abort();
+  }
+  chunk->previous = arena->current;
+  chunk->size = size;
+  chunk->used = 0;
+  arena->current = chunk;
+  ++arena->num_chunks_allocated;
+}
+
+static void free_chunks(struct arena *arena) {
+  while (arena->current != NULL) {
+    struct arena_chunk *previous = arena->current->previous;
+    free(arena->current);
+    arena->current = previous;
+  }
+}
+
+void init_arena(struct arena *arena) {
+  arena->current = NULL;
+  arena->in_use = 0;
+  arena->peak = 0;
+  arena->num_chunks_allocated = 0;
+  push_chunk(arena, INITIAL_ARENA_SIZE);
+}
+
+void *arena_alloc(struct arena *arena, size_t bytes) {
+  bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  struct arena_chunk *chunk = arena->current;
+  if (chunk->size - chunk->used < bytes) {
+    size_t size = 2 * chunk->size;
+    if (size < bytes) {
+      size = bytes;
+    }
+    push_chunk(arena, size);
+    chunk = arena->current;
+  }
+  void *ret = (char*)chunk + CHUNK_HEADER_SIZE + chunk->used;
+  chunk->used += bytes;
+  arena->in_use += bytes;
+  if (arena->in_use > arena->peak) {
+    arena->peak = arena->in_use;
+  }
+  return ret;
+}
+
+void *arena_calloc(struct arena *arena, size_t bytes) {
+  void *ret = arena_alloc(arena, bytes);
+  memset(ret, 0, bytes);
+  return ret;
+}
+
+void reset_arena(struct arena *arena) {
+  if (arena->current->previous != NULL) {
+    size_t total = 0;
+    for (struct arena_chunk *chunk = arena->current; chunk != NULL;
+         chunk = chunk->previous) {
+      total += chunk->size;
+    }
+    free_chunks(arena);
+    push_chunk(arena, total <= MAX_RETAINED_ARENA_SIZE
+               ? total : INITIAL_ARENA_SIZE);
+  } else if (arena->current->size > MAX_RETAINED_ARENA_SIZE) {
+    free_chunks(arena);
+    push_chunk(arena, INITIAL_ARENA_SIZE);
+  }
+  arena->current->used = 0;
+  arena->in_use = 0;
+}
+
+void free_arena(struct arena *arena) {
+  free_chunks(arena);
+}
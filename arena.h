@@ -0,0 +1,45 @@
+/* Per-thread scratch memory for scoring work items. Allocations are
+   carved out of large chunks and released all at once by
+   reset_arena. When an item needed more than one chunk, reset
+   replaces the chunks with a single one big enough for all of them,
+   so once the largest item has been seen, scoring allocates nothing
+   from the system. Memory is not cleared on reset; callers clear what
+   they use. */
+
+#ifndef __arena_h__
+#define __arena_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGNMENT 64
+#define INITIAL_ARENA_SIZE (1 << 20)
+/* Scratch memory beyond this is returned to the system on reset rather
+   than kept for the next item, so one huge item does not pin its
+   memory for the rest of the run. */
+#define MAX_RETAINED_ARENA_SIZE ((size_t)256 << 20)
+
+struct arena_chunk {
+  struct arena_chunk *previous;
+  size_t size;
+  size_t used;
+  /* Followed by size bytes. */
+};
+
+struct arena {
+  struct arena_chunk *current;
+  /* Bytes allocated since the last reset. */
+  size_t in_use;
+  size_t peak;
+  /* Chunks requested from the system. */
+  int64_t num_chunks_allocated;
+};
+
+void init_arena(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t bytes);
+/* arena_alloc, with the bytes cleared. */
+void *arena_calloc(struct arena *arena, size_t bytes);
+void reset_arena(struct arena *arena);
+void free_arena(struct arena *arena);
+
+#endif
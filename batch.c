@@ -0,0 +1,439 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "batch.h"
+#include "read_mmap.h"
+#include "score_thread.h"
+
+struct page_ref {
+  int64_t page;
+  int item;
+};
+
+static int compare_page_refs(const void *a, const void *b) {
+  const struct page_ref *first = a;
+  const struct page_ref *second = b;
+  if (first->page != second->page) {
+    return first->page < second->page ? -1 : 1;
+  }
+  return first->item - second->item;
+}
+
+struct counted_item {
+  int64_t count;
+  int item;
+};
+
+static int compare_by_count_desc(const void *a, const void *b) {
+  const struct counted_item *first = a;
+  const struct counted_item *second = b;
+  if (first->count != second->count) {
+    return first->count > second->count ? -1 : 1;
+  }
+  return first->item - second->item;
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t first = *(const int64_t*)a;
+  int64_t second = *(const int64_t*)b;
+  return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+void init_batcher(struct batcher *b, int window, const char *mmap_users,
+                  const struct mmap_item *users, int64_t num_users) {
+  b->mmap_users = mmap_users;
+  b->users = users;
+  b->num_users = num_users;
+  b->window = window;
+  b->pending = malloc(window * sizeof(struct user_group*));
+  b->num_pending = 0;
+  b->pending_groups = malloc(window * sizeof(struct user_group*));
+  b->num_pending_groups = 0;
+  b->num_batches = 0;
+  b->num_batched_users = 0;
+  b->num_chains = 0;
+  b->num_chained_groups = 0;
+}
+
+void free_batcher(struct batcher *b) {
+  assert(b->num_pending == 0 && b->num_pending_groups == 0);
+  free(b->pending);
+  free(b->pending_groups);
+  b->pending = NULL;
+  b->pending_groups = NULL;
+}
+
+static int batchable(const struct batcher *b, const struct user_group *work) {
+  if (work->num_users != 1 || work->userids[0] >= b->num_users) {
+    return 0;
+  }
+  const struct mmap_item *user = b->users + work->userids[0];
+  return get_features(b->mmap_users, user) != NULL
+      && user->count_features > 1
+      && user->count_features <= MAX_BATCH_PAGES;
+}
+
+static int chainable(const struct batcher *b, const struct user_group *work) {
+  if (work->num_users < MIN_CHAIN_CORE || work->pages != NULL) {
+    return 0;
+  }
+  for (int i = 0; i < work->num_users; ++i) {
+    if (work->userids[i] >= b->num_users) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void flush_users(struct batcher *b, emit_batch_fn emit,
+                        void *context);
+static void flush_groups(struct batcher *b, emit_batch_fn emit,
+                         void *context);
+
+void batcher_add(struct batcher *b, struct user_group *work,
+                 emit_batch_fn emit, void *context) {
+  work->next = NULL;
+  if (chainable(b, work)) {
+    b->pending_groups[b->num_pending_groups++] = work;
+    if (b->num_pending_groups == b->window) {
+      flush_groups(b, emit, context);
+    }
+    return;
+  }
+  if (!batchable(b, work)) {
+    emit(work, context);
+    return;
+  }
+  b->pending[b->num_pending++] = work;
+  if (b->num_pending == b->window) {
+    flush_users(b, emit, context);
+  }
+}
+
+void batcher_flush(struct batcher *b, emit_batch_fn emit, void *context) {
+  flush_users(b, emit, context);
+  flush_groups(b, emit, context);
+}
+
+static void flush_users(struct batcher *b, emit_batch_fn emit,
+                        void *context) {
+  int n = b->num_pending;
+  if (n == 0) {
+    return;
+  }
+  // Inverted index from pages to the pending items that touch them.
+  int64_t *counts = malloc(n * sizeof(int64_t));
+  int64_t *offsets = malloc((n + 1) * sizeof(int64_t));
+  offsets[0] = 0;
+  for (int i = 0; i < n; ++i) {
+    counts[i] = b->users[b->pending[i]->userids[0]].count_features;
+    offsets[i + 1] = offsets[i] + counts[i];
+  }
+  int64_t num_refs = offsets[n];
+  struct page_ref *refs = malloc(num_refs * sizeof(struct page_ref));
+  for (int i = 0; i < n; ++i) {
+    const struct mmap_item *user = b->users + b->pending[i]->userids[0];
+    const struct mmap_feature *user_pages = get_features(b->mmap_users,
+                                                         user);
+    for (int64_t k = 0; k < counts[i]; ++k) {
+      refs[offsets[i] + k].page = user_pages[k].feature_number;
+      refs[offsets[i] + k].item = i;
+    }
+  }
+  qsort(refs, num_refs, sizeof(struct page_ref), compare_page_refs);
+  // Number the distinct pages, and list each item's distinct page
+  // numbers.
+  int64_t *posting_starts = malloc((num_refs + 1) * sizeof(int64_t));
+  int64_t *item_pages = malloc(num_refs * sizeof(int64_t));
+  int64_t *fill = malloc(n * sizeof(int64_t));
+  memcpy(fill, offsets, n * sizeof(int64_t));
+  int64_t num_distinct = 0;
+  for (int64_t r = 0; r < num_refs; ++r) {
+    if (r == 0 || refs[r].page != refs[r - 1].page) {
+      posting_starts[num_distinct++] = r;
+    }
+    item_pages[fill[refs[r].item]++] = num_distinct - 1;
+  }
+  posting_starts[num_distinct] = num_refs;
+
+  struct counted_item *order = malloc(n * sizeof(struct counted_item));
+  for (int i = 0; i < n; ++i) {
+    order[i].count = counts[i];
+    order[i].item = i;
+  }
+  qsort(order, n, sizeof(struct counted_item), compare_by_count_desc);
+  int *assigned = calloc(n, sizeof(int));
+  // overlap[c] counts c's pages in the union of the batch numbered
+  // overlap_batch[c], and is stale for any other batch.
+  int64_t *overlap = malloc(n * sizeof(int64_t));
+  int *overlap_batch = malloc(n * sizeof(int));
+  // Unassigned items sharing a page with the batch.
+  int *candidates = malloc(n * sizeof(int));
+  int *mark = malloc(num_distinct * sizeof(int));
+  for (int i = 0; i < n; ++i) {
+    overlap_batch[i] = -1;
+  }
+  for (int64_t u = 0; u < num_distinct; ++u) {
+    mark[u] = -1;
+  }
+  int members[MAX_BATCH_USERS];
+  int batch_id = 0;
+  for (int o = 0; o < n; ++o) {
+    int seed = order[o].item;
+    if (assigned[seed]) {
+      continue;
+    }
+    int num_members = 0;
+    int num_candidates = 0;
+    int64_t union_size = 0;
+    int next = seed;
+    // Grow the batch greedily with the user whose pages are best
+    // covered by the union so far. Only items reached through the
+    // posting lists of the union's pages can overlap it.
+    while (next >= 0) {
+      assigned[next] = 1;
+      members[num_members++] = next;
+      for (int64_t k = offsets[next]; k < offsets[next + 1]; ++k) {
+        int64_t u = item_pages[k];
+        if (mark[u] == batch_id) {
+          continue;
+        }
+        mark[u] = batch_id;
+        ++union_size;
+        for (int64_t r = posting_starts[u]; r < posting_starts[u + 1]; ++r) {
+          int c = refs[r].item;
+          if (assigned[c]) {
+            continue;
+          }
+          if (overlap_batch[c] != batch_id) {
+            overlap_batch[c] = batch_id;
+            overlap[c] = 0;
+            candidates[num_candidates++] = c;
+          }
+          ++overlap[c];
+        }
+      }
+      next = -1;
+      if (num_members == MAX_BATCH_USERS) {
+        break;
+      }
+      double best_fraction = MIN_BATCH_OVERLAP;
+      int num_kept = 0;
+      for (int i = 0; i < num_candidates; ++i) {
+        int c = candidates[i];
+        if (assigned[c]) {
+          continue;
+        }
+        candidates[num_kept++] = c;
+        if (union_size + counts[c] - overlap[c] > MAX_BATCH_PAGES) {
+          continue;
+        }
+        // Ties go to the later item.
+        double fraction = (double)overlap[c] / counts[c];
+        if (fraction > best_fraction
+            || (fraction == best_fraction && c > next)) {
+          best_fraction = fraction;
+          next = c;
+        }
+      }
+      num_candidates = num_kept;
+    }
+    for (int m = 0; m < num_members; ++m) {
+      b->pending[members[m]]->next = m + 1 < num_members
+          ? b->pending[members[m + 1]] : NULL;
+    }
+    if (num_members > 1) {
+      ++b->num_batches;
+      b->num_batched_users += num_members;
+    }
+    emit(b->pending[members[0]], context);
+    ++batch_id;
+  }
+  b->num_pending = 0;
+  free(counts);
+  free(offsets);
+  free(refs);
+  free(posting_starts);
+  free(item_pages);
+  free(fill);
+  free(order);
+  free(assigned);
+  free(overlap);
+  free(overlap_batch);
+  free(candidates);
+  free(mark);
+}
+
+/* Count the members common to the sorted lists first and second,
+   writing them to common if it is not NULL. common may be first. */
+static int intersect_members(const int64_t *first, int first_count,
+                             const int64_t *second, int second_count,
+                             int64_t *common) {
+  int i = 0;
+  int j = 0;
+  int count = 0;
+  while (i < first_count && j < second_count) {
+    if (first[i] < second[j]) {
+      ++i;
+    } else if (first[i] > second[j]) {
+      ++j;
+    } else {
+      if (common != NULL) {
+        common[count] = first[i];
+      }
+      ++count;
+      ++i;
+      ++j;
+    }
+  }
+  return count;
+}
+
+static int64_t *sorted_members(const struct user_group *group) {
+  int64_t *members = malloc(group->num_users * sizeof(int64_t));
+  memcpy(members, group->userids, group->num_users * sizeof(int64_t));
+  qsort(members, group->num_users, sizeof(int64_t), compare_int64);
+  return members;
+}
+
+/* Chain pending groups in input order: each unassigned group starts a
+   chain, which takes every later group that shares enough members with
+   its core, narrowing the core to the members they share. */
+static void flush_groups(struct batcher *b, emit_batch_fn emit,
+                         void *context) {
+  int n = b->num_pending_groups;
+  if (n == 0) {
+    return;
+  }
+  int64_t **members = malloc(n * sizeof(int64_t*));
+  for (int i = 0; i < n; ++i) {
+    members[i] = sorted_members(b->pending_groups[i]);
+  }
+  int *assigned = calloc(n, sizeof(int));
+  struct user_group *chain[MAX_CHAIN_GROUPS];
+  for (int seed = 0; seed < n; ++seed) {
+    if (assigned[seed]) {
+      continue;
+    }
+    assigned[seed] = 1;
+    int64_t *core = members[seed];
+    int core_size = b->pending_groups[seed]->num_users;
+    int length = 0;
+    chain[length++] = b->pending_groups[seed];
+    for (int c = seed + 1; c < n && length < MAX_CHAIN_GROUPS; ++c) {
+      if (assigned[c]) {
+        continue;
+      }
+      int count = b->pending_groups[c]->num_users;
+      int common = intersect_members(core, core_size, members[c], count,
+                                     NULL);
+      if (common < MIN_CHAIN_CORE || common < MIN_BATCH_OVERLAP * count
+          || common < MIN_BATCH_OVERLAP * core_size) {
+        continue;
+      }
+      core_size = intersect_members(core, core_size, members[c], count,
+                                    core);
+      assigned[c] = 1;
+      chain[length++] = b->pending_groups[c];
+    }
+    for (int m = 0; m < length; ++m) {
+      chain[m]->next = m + 1 < length ? chain[m + 1] : NULL;
+    }
+    if (length > 1) {
+      ++b->num_chains;
+      b->num_chained_groups += length;
+    }
+    emit(chain[0], context);
+  }
+  for (int i = 0; i < n; ++i) {
+    free(members[i]);
+  }
+  free(members);
+  free(assigned);
+  b->num_pending_groups = 0;
+}
+
+int chain_core(const struct user_group *chain, int64_t *core) {
+  int64_t *first = sorted_members(chain);
+  int core_size = chain->num_users;
+  memcpy(core, first, core_size * sizeof(int64_t));
+  free(first);
+  for (const struct user_group *g = chain->next; g != NULL; g = g->next) {
+    int64_t *members = sorted_members(g);
+    core_size = intersect_members(core, core_size, members, g->num_users,
+                                  core);
+    free(members);
+  }
+  return core_size >= MIN_CHAIN_CORE ? core_size : 0;
+}
+
+int init_sim_cache(struct sim_cache *cache, const struct user_group *batch,
+                   const char *mmap_users, const struct mmap_item *users,
+                   int max_pages) {
+  int64_t total = 0;
+  for (const struct user_group *g = batch; g != NULL; g = g->next) {
+    for (int m = 0; m < g->num_users; ++m) {
+      total += users[g->userids[m]].count_features;
+    }
+  }
+  cache->page_ids = malloc(total * sizeof(int64_t));
+  int64_t k = 0;
+  for (const struct user_group *g = batch; g != NULL; g = g->next) {
+    for (int m = 0; m < g->num_users; ++m) {
+      const struct mmap_item *user = users + g->userids[m];
+      const struct mmap_feature *user_pages = get_features(mmap_users,
+                                                           user);
+      for (int64_t i = 0; user_pages != NULL && i < user->count_features;
+           ++i) {
+        cache->page_ids[k++] = user_pages[i].feature_number;
+      }
+    }
+  }
+  total = k;
+  qsort(cache->page_ids, total, sizeof(int64_t), compare_int64);
+  int num_pages = 0;
+  for (int64_t i = 0; i < total; ++i) {
+    if (i == 0 || cache->page_ids[i] != cache->page_ids[i - 1]) {
+      cache->page_ids[num_pages++] = cache->page_ids[i];
+    }
+  }
+  if (num_pages > max_pages) {
+    free(cache->page_ids);
+    cache->page_ids = NULL;
+    return 0;
+  }
+  cache->num_pages = num_pages;
+  size_t size = (size_t)num_pages * (size_t)num_pages;
+  cache->similarities = malloc(size * sizeof(double));
+  for (size_t i = 0; i < size; ++i) {
+    cache->similarities[i] = NAN;
+  }
+  cache->evaluations = 0;
+  return 1;
+}
+
+int sim_cache_index(const struct sim_cache *cache, int64_t page_id) {
+  int low = 0;
+  int high = cache->num_pages - 1;
+  while (low <= high) {
+    int middle = low + (high - low) / 2;
+    if (cache->page_ids[middle] < page_id) {
+      low = middle + 1;
+    } else if (cache->page_ids[middle] > page_id) {
+      high = middle - 1;
+    } else {
+      return middle;
+    }
+  }
+  assert(0);
+  return -1;
+}
+
+void free_sim_cache(struct sim_cache *cache) {
+  free(cache->page_ids);
+  free(cache->similarities);
+  cache->page_ids = NULL;
+  cache->similarities = NULL;
+}
@@ -0,0 +1,90 @@
+/* Page-locality batching. The reader collects a window of single-user
+   work items and chains users that share many pages into batches
+   (linked through user_group->next), so one worker scores them
+   back to back. The worker computes each similarity between pages in
+   the batch's union at most once, in a batch-local matrix that every
+   member's graph is built from.
+
+   Groups of several users are chained the same way, by shared members
+   rather than shared pages: a group joins a chain when most of its
+   members are in the chain's core, the members common to every group
+   in it. The worker merges the core's page vectors once per chain and
+   builds each group's vector from the core and the remaining members,
+   and the chain's groups share one similarity matrix over their
+   union. */
+
+#ifndef __batch_h__
+#define __batch_h__
+
+#include <stdint.h>
+
+struct user_group;
+struct mmap_item;
+
+/* Batches stop growing at this many users or union pages. */
+#define MAX_BATCH_USERS 64
+#define MAX_BATCH_PAGES 1024
+/* A user joins a batch only if at least this fraction of its pages are
+   already in the batch's union. */
+#define MIN_BATCH_OVERLAP 0.5
+/* Group chains stop growing at this many groups. A group joins only if
+   it shares at least MIN_BATCH_OVERLAP of its members with the chain's
+   core, which keeps at least this fraction of its members too. */
+#define MAX_CHAIN_GROUPS 64
+#define MIN_CHAIN_CORE 2
+/* Chains whose union has more pages than this are scored without a
+   shared similarity matrix, which takes eight bytes per page pair. */
+#define MAX_SHARED_SIM_PAGES 2048
+
+typedef void (*emit_batch_fn)(struct user_group *batch, void *context);
+
+struct batcher {
+  const char *mmap_users;
+  const struct mmap_item *users;
+  int64_t num_users;
+  int window;
+  struct user_group **pending;
+  int num_pending;
+  struct user_group **pending_groups;
+  int num_pending_groups;
+  int64_t num_batches;
+  int64_t num_batched_users;
+  int64_t num_chains;
+  int64_t num_chained_groups;
+};
+
+void init_batcher(struct batcher *b, int window, const char *mmap_users,
+                  const struct mmap_item *users, int64_t num_users);
+/* Add a work item. Users that cannot be batched are emitted
+   immediately; others are emitted in batches once the window fills.
+   Groups of several users have a window of their own. */
+void batcher_add(struct batcher *b, struct user_group *work,
+                 emit_batch_fn emit, void *context);
+/* Emit everything still pending. */
+void batcher_flush(struct batcher *b, emit_batch_fn emit, void *context);
+void free_batcher(struct batcher *b);
+
+/* Lazily filled similarities between the union pages of a batch. */
+struct sim_cache {
+  int num_pages;
+  int64_t *page_ids;
+  /* num_pages x num_pages, NAN where not yet computed. */
+  double *similarities;
+  int64_t evaluations;
+};
+
+/* Build the cache for a chain of work items, over the union of all
+   their members' pages. Returns 0, with nothing allocated, if the union
+   has more than max_pages pages. */
+int init_sim_cache(struct sim_cache *cache, const struct user_group *batch,
+                   const char *mmap_users, const struct mmap_item *users,
+                   int max_pages);
+/* Members common to every group in a chain of groups, sorted, or 0 if
+   there are fewer than MIN_CHAIN_CORE. core holds room for the first
+   group's members. */
+int chain_core(const struct user_group *chain, int64_t *core);
+/* Index of page_id in the cache's union. page_id must be present. */
+int sim_cache_index(const struct sim_cache *cache, int64_t page_id);
+void free_sim_cache(struct sim_cache *cache);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "block_cache.h"
+
+void init_block_cache(struct block_cache *cache, const char *mfile,
+                      int64_t capacity) {
+  cache->mfile = mfile;
+  cache->blocks = get_blocks(mfile, &cache->num_blocks);
+  int64_t entries_per_shard = cache->num_blocks / BLOCK_CACHE_SHARDS + 1;
+  for (int s = 0; s < BLOCK_CACHE_SHARDS; ++s) {
+    struct cache_shard *shard = cache->shards + s;
+    pthread_mutex_init(&shard->lock, NULL);
+    pthread_cond_init(&shard->loaded, NULL);
+    shard->entries = calloc(entries_per_shard, sizeof(struct cached_block*));
+    shard->lru.lru_previous = &shard->lru;
+    shard->lru.lru_next = &shard->lru;
+    shard->bytes = 0;
+    shard->capacity = capacity / BLOCK_CACHE_SHARDS;
+    shard->peak_bytes = 0;
+    shard->hits = 0;
+    shard->misses = 0;
+    shard->evictions = 0;
+  }
+}
+
+static void lru_unlink(struct cached_block *entry) {
+  entry->lru_previous->lru_next = entry->lru_next;
+  entry->lru_next->lru_previous = entry->lru_previous;
+}
+
+static void lru_push_front(struct cache_shard *shard,
+                           struct cached_block *entry) {
+  entry->lru_previous = &shard->lru;
+  entry->lru_next = shard->lru.lru_next;
+  shard->lru.lru_next->lru_previous = entry;
+  shard->lru.lru_next = entry;
+}
+
+/* Drop unpinned blocks, least recently used first, until the shard is
+   within its capacity. Called with the shard locked. */
+static void evict(struct cache_shard *shard) {
+  struct cached_block *entry = shard->lru.lru_previous;
+  while (shard->bytes > shard->capacity && entry != &shard->lru) {
+    struct cached_block *previous = entry->lru_previous;
+    if (entry->pins == 0) {
+      lru_unlink(entry);
+      shard->entries[entry->block / BLOCK_CACHE_SHARDS] = NULL;
+      shard->bytes -= entry->bytes;
+      ++shard->evictions;
+      free(entry->features);
+      free(entry);
+    }
+    entry = previous;
+  }
+}
+
+const struct mmap_feature *pin_page_features(struct block_cache *cache,
+                                             const struct mmap_item *page) {
+  if (page->features_offset == 0) {
+    return NULL;
+  }
+  int64_t block = page_block(page);
+  assert(block >= 0 && block < cache->num_blocks);
+  struct cache_shard *shard = cache->shards + block % BLOCK_CACHE_SHARDS;
+  struct cached_block **slot = shard->entries + block / BLOCK_CACHE_SHARDS;
+  pthread_mutex_lock(&shard->lock);
+  struct cached_block *entry = *slot;
+  if (entry != NULL) {
+    ++entry->pins;
+    ++shard->hits;
+    while (entry->loading) {
+      pthread_cond_wait(&shard->loaded, &shard->lock);
+    }
+    lru_unlink(entry);
+    lru_push_front(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+  } else {
+    ++shard->misses;
+    entry = malloc(sizeof(struct cached_block));
+    entry->block = block;
+    entry->pins = 1;
+    entry->loading = 1;
+    *slot = entry;
+    pthread_mutex_unlock(&shard->lock);
+
+    const struct block_info *info = cache->blocks + block;
+    entry->bytes = info->num_features * sizeof(struct mmap_feature);
+    entry->features = malloc(entry->bytes);
+    decode_block(cache->mfile, info, entry->features);
+
+    pthread_mutex_lock(&shard->lock);
+    entry->loading = 0;
+    lru_push_front(shard, entry);
+    shard->bytes += entry->bytes;
+    if (shard->bytes > shard->peak_bytes) {
+      shard->peak_bytes = shard->bytes;
+    }
+    evict(shard);
+    pthread_cond_broadcast(&shard->loaded);
+    pthread_mutex_unlock(&shard->lock);
+  }
+  return entry->features + page_block_position(page);
+}
+
+void unpin_block(struct block_cache *cache, int64_t block) {
+  struct cache_shard *shard = cache->shards + block % BLOCK_CACHE_SHARDS;
+  pthread_mutex_lock(&shard->lock);
+  struct cached_block *entry = shard->entries[block / BLOCK_CACHE_SHARDS];
+  assert(entry != NULL && entry->pins > 0);
+  if (--entry->pins == 0 && shard->bytes > shard->capacity) {
+    evict(shard);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void block_cache_stats(const struct block_cache *cache, int64_t *hits,
+                       int64_t *misses, int64_t *evictions,
+                       int64_t *peak_bytes) {
+  *hits = 0;
+  *misses = 0;
+  *evictions = 0;
+  *peak_bytes = 0;
+  for (int s = 0; s < BLOCK_CACHE_SHARDS; ++s) {
+    *hits += cache->shards[s].hits;
+    *misses += cache->shards[s].misses;
+    *evictions += cache->shards[s].evictions;
+    *peak_bytes += cache->shards[s].peak_bytes;
+  }
+}
+
+void free_block_cache(struct block_cache *cache) {
+  for (int s = 0; s < BLOCK_CACHE_SHARDS; ++s) {
+    struct cache_shard *shard = cache->shards + s;
+    struct cached_block *entry = shard->lru.lru_next;
+    while (entry != &shard->lru) {
+      struct cached_block *next = entry->lru_next;
+      assert(entry->pins == 0);
+      free(entry->features);
+      free(entry);
+      entry = next;
+    }
+    free(shard->entries);
+    pthread_mutex_destroy(&shard->lock);
+    pthread_cond_destroy(&shard->loaded);
+  }
+}
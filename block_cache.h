@@ -0,0 +1,69 @@
+/* Decompressed blocks of a block store (see block_store.h), shared by
+   every scoring thread. Blocks are spread over shards by block number,
+   each with its own lock and LRU list, so threads working on different
+   blocks rarely contend. A thread pins the blocks of the pages it is
+   scoring and unpins them when the item is done; pinned blocks are
+   never evicted, so the cache may briefly exceed its capacity when the
+   pinned blocks alone do not fit. A block is decompressed by the
+   thread that missed it, outside the shard lock; other threads that
+   want it meanwhile wait for it rather than decompressing it again. */
+
+#ifndef __block_cache_h__
+#define __block_cache_h__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "block_store.h"
+
+#define BLOCK_CACHE_SHARDS 16
+#define DEFAULT_BLOCK_CACHE_SIZE ((int64_t)256 << 20)
+
+struct cached_block {
+  int64_t block;
+  struct mmap_feature *features;
+  int64_t bytes;
+  int pins;
+  int loading;
+  /* Most recently used first; only linked while loaded. */
+  struct cached_block *lru_previous;
+  struct cached_block *lru_next;
+};
+
+struct cache_shard {
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+  /* The shard's blocks, indexed by block / BLOCK_CACHE_SHARDS. */
+  struct cached_block **entries;
+  /* Sentinel of the LRU list. */
+  struct cached_block lru;
+  int64_t bytes;
+  int64_t capacity;
+  int64_t peak_bytes;
+  int64_t hits;
+  int64_t misses;
+  int64_t evictions;
+};
+
+struct block_cache {
+  const char *mfile;
+  const struct block_info *blocks;
+  int64_t num_blocks;
+  struct cache_shard shards[BLOCK_CACHE_SHARDS];
+};
+
+void init_block_cache(struct block_cache *cache, const char *mfile,
+                      int64_t capacity);
+/* Pin the block holding page's features and return them, or NULL if
+   the page has none. A page's block is page_block(page). */
+const struct mmap_feature *pin_page_features(struct block_cache *cache,
+                                             const struct mmap_item *page);
+void unpin_block(struct block_cache *cache, int64_t block);
+/* Totals over the shards. peak_bytes adds up the shards' peaks, which
+   may not have coincided. */
+void block_cache_stats(const struct block_cache *cache, int64_t *hits,
+                       int64_t *misses, int64_t *evictions,
+                       int64_t *peak_bytes);
+void free_block_cache(struct block_cache *cache);
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "block_store.h"
+
+/* Largest encoding of one feature: two ten-byte varints, or a varint
+   and a double. */
+#define MAX_ENCODED_FEATURE 20
+
+const struct block_store_header *get_block_store(const char *mfile) {
+  const struct mmap_header *header = (const struct mmap_header*)mfile;
+  if (header->data_offset != sizeof(struct mmap_header)
+      + sizeof(struct block_store_header)) {
+    return NULL;
+  }
+  const struct block_store_header *store
+      = (const struct block_store_header*)(mfile
+                                           + sizeof(struct mmap_header));
+  return store->magic == BLOCK_STORE_MAGIC ? store : NULL;
+}
+
+const struct block_info *get_blocks(const char *mfile, int64_t *num_blocks) {
+  const struct block_store_header *store = get_block_store(mfile);
+  assert(store != NULL);
+  *num_blocks = store->num_blocks;
+  return (const struct block_info*)(mfile + store->blocks_offset);
+}
+
+static inline uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline unsigned char *put_varint(unsigned char *out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (unsigned char)value;
+  return out;
+}
+
+static inline const unsigned char *get_varint(const unsigned char *in,
+                                              uint64_t *value) {
+  uint64_t result = 0;
+  int shift = 0;
+  while (*in & 0x80) {
+    result |= (uint64_t)(*in++ & 0x7f) << shift;
+    shift += 7;
+  }
+  *value = result | ((uint64_t)*in++ << shift);
+  return in;
+}
+
+static int is_small_integer(double value) {
+  return value >= 0.0 && value < 9007199254740992.0 && value == floor(value);
+}
+
+void decode_block(const char *mfile, const struct block_info *block,
+                  struct mmap_feature *features) {
+  const unsigned char *in = (const unsigned char*)mfile + block->data_offset;
+  int integer_values = (block->flags & BLOCK_INTEGER_VALUES) != 0;
+  int64_t feature_number = 0;
+  for (int64_t i = 0; i < block->num_features; ++i) {
+    uint64_t delta;
+    in = get_varint(in, &delta);
+    feature_number += unzigzag(delta);
+    features[i].feature_number = feature_number;
+    if (integer_values) {
+      uint64_t value;
+      in = get_varint(in, &value);
+      features[i].feature_value = (double)value;
+    } else {
+      memcpy(&features[i].feature_value, in, sizeof(double));
+      in += sizeof(double);
+    }
+  }
+  assert(in == (const unsigned char*)mfile + block->data_offset
+         + block->data_size);
+}
+
+/* Encode the features of pages [first_page, end_page) as one block,
+   returning the encoded size. */
+static int64_t encode_block(const char *pages_mfile,
+                            const struct mmap_item *pages,
+                            int64_t first_page, int64_t end_page,
+                            unsigned char *out, int64_t *flags) {
+  *flags = BLOCK_INTEGER_VALUES;
+  for (int64_t p = first_page; p < end_page; ++p) {
+    const struct mmap_feature *features = get_features(pages_mfile,
+                                                       pages + p);
+    for (int64_t i = 0; features != NULL && i < pages[p].count_features;
+         ++i) {
+      if (!is_small_integer(features[i].feature_value)) {
+        *flags = 0;
+      }
+    }
+  }
+  unsigned char *start = out;
+  int64_t previous = 0;
+  for (int64_t p = first_page; p < end_page; ++p) {
+    const struct mmap_feature *features = get_features(pages_mfile,
+                                                       pages + p);
+    if (features == NULL) {
+      continue;
+    }
+    for (int64_t i = 0; i < pages[p].count_features; ++i) {
+      out = put_varint(out, zigzag(features[i].feature_number - previous));
+      previous = features[i].feature_number;
+      if (*flags & BLOCK_INTEGER_VALUES) {
+        out = put_varint(out, (uint64_t)features[i].feature_value);
+      } else {
+        memcpy(out, &features[i].feature_value, sizeof(double));
+        out += sizeof(double);
+      }
+    }
+  }
+  return out - start;
+}
+
+void write_block_store(const char *pages_file, const char *out_file) {
+  int pages_mmapfd;
+  const char *pages_mfile = open_mmap_read(pages_file, &pages_mmapfd);
+  int64_t num_pages;
+  const struct mmap_item *pages = get_items(pages_mfile, &num_pages);
+  if (get_block_store(pages_mfile) != NULL) {
+    fprintf(stderr, "%s is already compressed\n", pages_file);
+    exit(1);
+  }
+
+  // Assign pages to blocks, starting a new block when the next page
+  // would take the current one past the target size.
+  struct mmap_item *items = malloc(num_pages * sizeof(struct mmap_item));
+  int64_t *block_first_page = malloc((num_pages + 1) * sizeof(int64_t));
+  int64_t num_blocks = 0;
+  int64_t block_features = 0;
+  int64_t max_block_features = 0;
+  for (int64_t p = 0; p < num_pages; ++p) {
+    items[p] = pages[p];
+    if (pages[p].features_offset == 0 || pages[p].count_features == 0) {
+      items[p].features_offset = 0;
+      continue;
+    }
+    if (num_blocks == 0 || (block_features > 0 && block_features
+                            + pages[p].count_features
+                            > BLOCK_TARGET_FEATURES)) {
+      block_first_page[num_blocks++] = p;
+      block_features = 0;
+    }
+    assert(block_features + pages[p].count_features
+           < (INT64_C(1) << BLOCK_POSITION_BITS));
+    items[p].features_offset = (num_blocks << BLOCK_POSITION_BITS)
+        + block_features;
+    block_features += pages[p].count_features;
+    if (block_features > max_block_features) {
+      max_block_features = block_features;
+    }
+  }
+  block_first_page[num_blocks] = num_pages;
+
+  FILE *out = fopen(out_file, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open %s for writing\n", out_file);
+    exit(1);
+  }
+  struct mmap_header header;
+  header.data_offset = sizeof(struct mmap_header)
+      + sizeof(struct block_store_header);
+  header.item_count = num_pages;
+  struct block_store_header store;
+  store.magic = BLOCK_STORE_MAGIC;
+  store.num_blocks = num_blocks;
+  store.blocks_offset = 0;
+  store.reserved = 0;
+  fwrite(&header, sizeof(header), 1, out);
+  fwrite(&store, sizeof(store), 1, out);
+  fwrite(items, sizeof(struct mmap_item), num_pages, out);
+
+  struct block_info *blocks = malloc(
+      (num_blocks > 0 ? num_blocks : 1) * sizeof(struct block_info));
+  unsigned char *buffer = malloc(
+      (max_block_features > 0 ? max_block_features : 1)
+      * MAX_ENCODED_FEATURE);
+  int64_t offset = header.data_offset
+      + num_pages * sizeof(struct mmap_item);
+  int64_t total_features = 0;
+  for (int64_t b = 0; b < num_blocks; ++b) {
+    blocks[b].data_offset = offset;
+    blocks[b].data_size = encode_block(pages_mfile, pages,
+                                       block_first_page[b],
+                                       block_first_page[b + 1],
+                                       buffer, &blocks[b].flags);
+    blocks[b].num_features = 0;
+    for (int64_t p = block_first_page[b]; p < block_first_page[b + 1]; ++p) {
+      if (items[p].features_offset != 0) {
+        blocks[b].num_features += items[p].count_features;
+      }
+    }
+    total_features += blocks[b].num_features;
+    fwrite(buffer, 1, blocks[b].data_size, out);
+    offset += blocks[b].data_size;
+  }
+  // Keep the block table aligned for direct access through the map.
+  static const char padding[sizeof(int64_t)];
+  int64_t pad = (sizeof(int64_t) - offset % sizeof(int64_t))
+      % sizeof(int64_t);
+  fwrite(padding, 1, pad, out);
+  store.blocks_offset = offset + pad;
+  fwrite(blocks, sizeof(struct block_info), num_blocks, out);
+  fseek(out, sizeof(struct mmap_header), SEEK_SET);
+  fwrite(&store, sizeof(store), 1, out);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Could not write %s\n", out_file);
+    exit(1);
+  }
+
+  int64_t plain_size = total_features * sizeof(struct mmap_feature);
+  int64_t packed_size = offset - header.data_offset
+      - num_pages * (int64_t)sizeof(struct mmap_item);
+  printf("%s written: %" PRId64 " pages in %" PRId64 " blocks,"
+         " features %.1f MB -> %.1f MB\n", out_file, num_pages, num_blocks,
+         plain_size / 1048576.0, packed_size / 1048576.0);
+  free(buffer);
+  free(blocks);
+  free(block_first_page);
+  free(items);
+  munmap((void*)pages_mfile, get_mmap_size(pages_mmapfd));
+  close(pages_mmapfd);
+}
@@ -0,0 +1,70 @@
+/* A compressed form of pages_mmap, written by make_mmap
+   --compress-pages. The file starts like any other memory map, with an
+   mmap_header and one mmap_item per page, so item counts and norms are
+   read exactly as before. The feature lists are packed, in page order,
+   into blocks of whole pages holding about BLOCK_TARGET_FEATURES
+   features each. A page's features_offset records its block (plus one,
+   so that 0 still means "no features") and its position within the
+   decompressed block.
+
+   Within a block, each feature number is stored as a zigzag varint
+   delta from the previous feature in the block. Values are varints
+   when every value in the block is a non-negative integer, which is
+   the common case for counts, and raw doubles otherwise. Decoding is a
+   single forward pass with no tables.
+
+   Layout: mmap_header, block_store_header, the items, the compressed
+   blocks, and a block_info table at blocks_offset. */
+
+#ifndef __block_store_h__
+#define __block_store_h__
+
+#include <stdint.h>
+
+#include "read_mmap.h"
+
+#define BLOCK_STORE_MAGIC INT64_C(0x4b4c425350474150)
+#define BLOCK_TARGET_FEATURES 4096
+/* Bits of features_offset giving the position within the block. */
+#define BLOCK_POSITION_BITS 24
+
+/* Values in the block are varints rather than raw doubles. */
+#define BLOCK_INTEGER_VALUES 1
+
+struct block_store_header {
+  int64_t magic;
+  int64_t num_blocks;
+  int64_t blocks_offset;
+  int64_t reserved;
+};
+
+struct block_info {
+  int64_t data_offset;
+  int64_t data_size;
+  int64_t num_features;
+  int64_t flags;
+};
+
+/* Returns the store's header, or NULL if mfile is a plain memory
+   map. */
+const struct block_store_header *get_block_store(const char *mfile);
+const struct block_info *get_blocks(const char *mfile, int64_t *num_blocks);
+
+static inline int64_t page_block(const struct mmap_item *page) {
+  return (page->features_offset >> BLOCK_POSITION_BITS) - 1;
+}
+
+static inline int64_t page_block_position(const struct mmap_item *page) {
+  return page->features_offset & ((INT64_C(1) << BLOCK_POSITION_BITS) - 1);
+}
+
+/* Decode a block into features, which holds block->num_features
+   entries. */
+void decode_block(const char *mfile, const struct block_info *block,
+                  struct mmap_feature *features);
+
+/* Write the block store for the plain pages_mmap pages_file to
+   out_file. */
+void write_block_store(const char *pages_file, const char *out_file);
+
+#endif
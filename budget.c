@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "budget.h"
+
+void init_memory_budget(struct memory_budget *b, int64_t budget) {
+  assert(budget > 0);
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->released, NULL);
+  b->budget = budget;
+  b->reserved = 0;
+  b->waiting = 0;
+  b->peak = 0;
+  b->num_waits = 0;
+  b->next_ticket = 0;
+  b->serving = 0;
+}
+
+int64_t reserve_memory(struct memory_budget *b, int64_t bytes) {
+  if (bytes > b->budget) {
+    bytes = b->budget;
+  }
+  pthread_mutex_lock(&b->lock);
+  if (b->reserved + bytes + b->waiting > b->budget) {
+    ++b->num_waits;
+    b->waiting += bytes;
+    int64_t ticket = b->next_ticket++;
+    while (ticket != b->serving || b->reserved + bytes > b->budget) {
+      pthread_cond_wait(&b->released, &b->lock);
+    }
+    ++b->serving;
+    b->waiting -= bytes;
+    pthread_cond_broadcast(&b->released);
+  }
+  b->reserved += bytes;
+  if (b->reserved > b->peak) {
+    b->peak = b->reserved;
+  }
+  pthread_mutex_unlock(&b->lock);
+  return bytes;
+}
+
+void release_memory(struct memory_budget *b, int64_t reserved) {
+  pthread_mutex_lock(&b->lock);
+  b->reserved -= reserved;
+  assert(b->reserved >= 0);
+  pthread_cond_broadcast(&b->released);
+  pthread_mutex_unlock(&b->lock);
+}
+
+void free_memory_budget(struct memory_budget *b) {
+  pthread_mutex_destroy(&b->lock);
+  pthread_cond_destroy(&b->released);
+}
+
+int parse_bytes(const char *arg, int64_t *bytes) {
+  char *end;
+  double value = strtod(arg, &end);
+  if (end == arg || value <= 0.0) {
+    return 0;
+  }
+  switch (*end) {
+    case 'G': case 'g':
+      value *= 1024.0;
+      // Fall through
+    case 'M': case 'm':
+      value *= 1024.0;
+      // Fall through
+    case 'K': case 'k':
+      value *= 1024.0;
+      ++end;
+      break;
+  }
+  if (*end != '\0') {
+    return 0;
+  }
+  *bytes = (int64_t)value;
+  return *bytes > 0;
+}
@@ -0,0 +1,41 @@
+/* Admission control for the memory used by concurrent work items. A
+   worker reserves an item's estimated footprint before building its
+   graph, waiting while the reservation would push the total past the
+   budget. Waiting items are admitted first come, first served, and
+   hold back new reservations only as far as needed for them to fit
+   eventually, so small items keep flowing past a large one without
+   starving it. An item larger than the whole
+   budget runs alone. */
+
+#ifndef __budget_h__
+#define __budget_h__
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct memory_budget {
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  int64_t budget;
+  int64_t reserved;
+  /* Sum of the reservations waiting for memory. Waiters are admitted
+     in ticket order. */
+  int64_t waiting;
+  int64_t next_ticket;
+  int64_t serving;
+  int64_t peak;
+  int64_t num_waits;
+};
+
+void init_memory_budget(struct memory_budget *b, int64_t budget);
+/* Block until bytes can be reserved. Returns the amount actually
+   reserved, to be passed to release_memory. */
+int64_t reserve_memory(struct memory_budget *b, int64_t bytes);
+void release_memory(struct memory_budget *b, int64_t reserved);
+void free_memory_budget(struct memory_budget *b);
+
+/* Parse a byte count with an optional K, M, or G suffix. Returns 0 if
+   malformed. */
+int parse_bytes(const char *arg, int64_t *bytes);
+
+#endif
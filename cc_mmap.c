@@ -2,110 +2,996 @@
    and controversy scores in parallel, and write those scores to
    disk. */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
 
 #include "score_thread.h"
 #include "read_mmap.h"
 #include "queue.h"
+#include "numa.h"
+#include "shard.h"
+#include "checkpoint.h"
+#include "batch.h"
+#include "input.h"
+#include "top.h"
+#include "stream.h"
+#include "budget.h"
+#include "prefetch.h"
+#include "block_cache.h"
+#include "page_stats.h"
+#include "dedup.h"
+
+#define QUEUE_SIZE 100
+#define DEFAULT_CHECKPOINT_INTERVAL 60.0
+#define DEFAULT_STREAM_INTERVAL 1.0
+
+struct cc_options {
+  const char *users_mmap_file;
+  const char *pages_mmap_file;
+  const char *controversy_mmap_file;
+  const char *userids_file;
+  int num_threads;
+  /* Pin each worker to a core and give each NUMA node its own input
+     queue. */
+  int numa;
+  /* Also give each node its own copy of the page and controversy
+     maps. Implies numa. */
+  int numa_replicate;
+  /* Only score the items belonging to this shard. */
+  int sharded;
+  struct shard_spec shard;
+  /* Prepended to every output file name. */
+  const char *output_prefix;
+  /* Seconds between checkpoints, or 0 to disable checkpointing. */
+  double checkpoint_interval;
+  /* Skip items completed by a previous run and append to its
+     outputs. */
+  int resume;
+  /* Number of queued users to group into page-locality batches, or 0
+     to disable batching. */
+  int batch_window;
+  /* Number of queued users to deduplicate by normalized page vector,
+     or 0 to disable deduplication. */
+  int dedup_window;
+  /* userids_file holds count-prefixed binary lists. */
+  int binary_input;
+  /* Score every user in users_mmap; userids_file is ignored. */
+  int all_users;
+  /* If set, userids_file lists pageids, and the users who edited them
+     are found through this page_users_mmap and scored. */
+  const char *page_users_mmap_file;
+  enum metric metric;
+  /* Score cosine and JSD together, writing both sets of outputs. */
+  int multi_metric;
+  /* Only find and write the top_n items by CC score, or 0 to score
+     everything. */
+  int top_n;
+  /* userids_file is a stream of edit events (see stream.h). */
+  int stream;
+  /* Seconds between rescores of users with new events. */
+  double stream_interval;
+  /* Half-life of streamed edit weights in seconds, or 0 for no
+     decay. */
+  double half_life;
+  /* Bytes that concurrently scored items may use, or 0 for no
+     limit. */
+  int64_t memory_budget;
+  /* Score every item with the fused engine. */
+  int fused;
+  /* Storage of packed edges; reduced precisions imply fused. */
+  enum edge_precision precision;
+  /* Compare reduced-precision scores with full precision. */
+  int compare_precision;
+  /* Items per worker queue to read ahead with a prefetch thread, or 0
+     for no prefetching. */
+  int prefetch_depth;
+  /* Bytes of decompressed blocks to cache when pages_mmap is a block
+     store. */
+  int64_t page_cache_size;
+  /* Write per-page aggregates to page_stats_mmap. */
+  int page_aggregates;
+  /* Do not write raw_page_stats_out_X. */
+  int no_raw_page_stats;
+};
+
+void print_usage(const char *program) {
+  printf("Usage: %s users_mmap pages_mmap controversy_mmap"
+         " userids_file num_threads [options]\n"
+         "userids_file may be _ to score every user in users_mmap.\n"
+         "Options:\n"
+         "  --numa            pin workers to cores, one input queue"
+         " per NUMA node\n"
+         "  --numa-replicate  --numa, plus per-node copies of"
+         " pages_mmap and controversy_mmap\n"
+         "  --shard i/N       score only shard i of N, balanced by"
+         " estimated cost\n"
+         "  --shard-hash      assign shards by userid hash instead of"
+         " cost ranges\n"
+         "  --output-prefix P prepend P to output file names"
+         " (default shard<i>_ when sharded)\n"
+         "  --checkpoint S    record completed items every S seconds\n"
+         "  --resume          continue an interrupted checkpointed run\n"
+         "  --dedup W         score users with identical normalized"
+         " page vectors once,\n"
+         "                    looking at W users at a time\n"
+         "  --batch W         batch users sharing pages, and groups"
+         " sharing members,\n"
+         "                    looking at W users and W groups at a"
+         " time\n"
+         "  --binary-input    userids_file is a binary list written by"
+         " make_mmap\n"
+         "  --all-users       score every user in users_mmap\n"
+         "  --pages F         userids_file lists pageids; score the users"
+         " who edited them,\n"
+         "                    found through page_users_mmap F\n"
+         "  --metric M        page similarity: cosine (default), jsd,"
+         " jaccard, or\n"
+         "                    weighted-overlap, or cosine+jsd to score"
+         " both in one pass\n"
+         "  --top N           write only the N items with the highest CC,"
+         " pruning items\n"
+         "                    whose upper bound cannot reach them\n"
+         "  --stream          userids_file (- for stdin) is a stream of"
+         " userid pageid delta\n"
+         "                    edit events; rescore users as they change\n"
+         "  --stream-interval S  rescore changed users every S seconds"
+         " (default 1)\n"
+         "  --half-life S     decay streamed edit weights with half-life"
+         " S seconds\n"
+         "  --memory-budget B limit the memory of items scored at once"
+         " to B bytes\n"
+         "                    (K, M, or G suffixes allowed)\n"
+         "  --engine E        dense (default), or fused to build packed"
+         " rows of edges\n"
+         "                    and fold them into the scores as they are"
+         " built\n"
+         "  --precision P     store fused edges as double (default),"
+         " float, or uint16\n"
+         "  --compare-precision  also score at full precision and report"
+         " deviations\n"
+         "  --prefetch D      read ahead the page data of up to D queued"
+         " items per queue\n"
+         "  --page-cache B    cache B bytes of decompressed blocks when"
+         " pages_mmap is\n"
+         "                    compressed (default 256M)\n"
+         "  --page-aggregates write per-page user counts and mean"
+         " clustering to\n"
+         "                    page_stats_mmap\n"
+         "  --no-raw-page-stats  do not write raw_page_stats_out"
+         " files\n",
+         program);
+}
+
+int parse_options(int argc, char **argv, struct cc_options *opts) {
+  if (argc < 6) {
+    return 0;
+  }
+  memset(opts, 0, sizeof(struct cc_options));
+  opts->metric = METRIC_COSINE;
+  opts->page_cache_size = DEFAULT_BLOCK_CACHE_SIZE;
+  int shard_hash = 0;
+  opts->users_mmap_file = argv[1];
+  opts->pages_mmap_file = argv[2];
+  opts->controversy_mmap_file = argv[3];
+  opts->userids_file = argv[4];
+  opts->num_threads = atoi(argv[5]);
+  if (opts->num_threads < 1) {
+    return 0;
+  }
+  for (int i = 6; i < argc; ++i) {
+    if (strcmp(argv[i], "--numa") == 0) {
+      opts->numa = 1;
+    } else if (strcmp(argv[i], "--numa-replicate") == 0) {
+      opts->numa = 1;
+      opts->numa_replicate = 1;
+    } else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+      if (!parse_shard(argv[++i], &opts->shard)) {
+        fprintf(stderr, "Bad shard %s, expected i/N\n", argv[i]);
+        return 0;
+      }
+      opts->sharded = 1;
+    } else if (strcmp(argv[i], "--shard-hash") == 0) {
+      shard_hash = 1;
+    } else if (strcmp(argv[i], "--output-prefix") == 0 && i + 1 < argc) {
+      opts->output_prefix = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      opts->checkpoint_interval = atof(argv[++i]);
+      if (opts->checkpoint_interval <= 0.0) {
+        fprintf(stderr, "Checkpoint interval must be positive\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--resume") == 0) {
+      opts->resume = 1;
+    } else if (strcmp(argv[i], "--binary-input") == 0) {
+      opts->binary_input = 1;
+    } else if (strcmp(argv[i], "--all-users") == 0) {
+      opts->all_users = 1;
+    } else if (strcmp(argv[i], "--pages") == 0 && i + 1 < argc) {
+      opts->page_users_mmap_file = argv[++i];
+    } else if (strcmp(argv[i], "--metric") == 0 && i + 1 < argc) {
+      if (strcmp(argv[++i], "cosine+jsd") == 0) {
+        opts->multi_metric = 1;
+      } else if (!parse_metric(argv[i], &opts->metric)) {
+        fprintf(stderr, "Unknown metric %s\n", argv[i]);
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+      opts->top_n = atoi(argv[++i]);
+      if (opts->top_n < 1) {
+        fprintf(stderr, "--top needs a positive count\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      opts->stream = 1;
+    } else if (strcmp(argv[i], "--stream-interval") == 0 && i + 1 < argc) {
+      opts->stream_interval = atof(argv[++i]);
+      if (opts->stream_interval <= 0.0) {
+        fprintf(stderr, "Stream interval must be positive\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--half-life") == 0 && i + 1 < argc) {
+      opts->half_life = atof(argv[++i]);
+      if (opts->half_life <= 0.0) {
+        fprintf(stderr, "Half-life must be positive\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+      if (!parse_bytes(argv[++i], &opts->memory_budget)) {
+        fprintf(stderr, "Bad memory budget %s\n", argv[i]);
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      if (strcmp(argv[++i], "fused") == 0) {
+        opts->fused = 1;
+      } else if (strcmp(argv[i], "dense") != 0) {
+        fprintf(stderr, "Unknown engine %s\n", argv[i]);
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--precision") == 0 && i + 1 < argc) {
+      if (!parse_precision(argv[++i], &opts->precision)) {
+        fprintf(stderr, "Unknown precision %s\n", argv[i]);
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--compare-precision") == 0) {
+      opts->compare_precision = 1;
+    } else if (strcmp(argv[i], "--page-cache") == 0 && i + 1 < argc) {
+      if (!parse_bytes(argv[++i], &opts->page_cache_size)) {
+        fprintf(stderr, "Bad page cache size %s\n", argv[i]);
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--page-aggregates") == 0) {
+      opts->page_aggregates = 1;
+    } else if (strcmp(argv[i], "--no-raw-page-stats") == 0) {
+      opts->no_raw_page_stats = 1;
+    } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+      opts->prefetch_depth = atoi(argv[++i]);
+      if (opts->prefetch_depth < 1) {
+        fprintf(stderr, "Prefetch depth must be positive\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--dedup") == 0 && i + 1 < argc) {
+      opts->dedup_window = atoi(argv[++i]);
+      if (opts->dedup_window < 1) {
+        fprintf(stderr, "Dedup window must be positive\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      opts->batch_window = atoi(argv[++i]);
+      if (opts->batch_window < 1) {
+        fprintf(stderr, "Batch window must be positive\n");
+        return 0;
+      }
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 0;
+    }
+  }
+  if (shard_hash && !opts->sharded) {
+    fprintf(stderr, "--shard-hash requires --shard\n");
+    return 0;
+  }
+  opts->shard.by_hash = shard_hash;
+  if ((opts->page_aggregates || opts->no_raw_page_stats)
+      && (opts->top_n > 0 || opts->checkpoint_interval > 0.0
+          || opts->resume)) {
+    fprintf(stderr, "--page-aggregates and --no-raw-page-stats cannot be"
+            " combined with --top, --checkpoint, or --resume\n");
+    return 0;
+  }
+  if (opts->page_aggregates && opts->stream) {
+    fprintf(stderr, "--page-aggregates cannot be combined with"
+            " --stream\n");
+    return 0;
+  }
+  if (opts->stream) {
+    if (opts->top_n > 0 || opts->batch_window > 0 || opts->sharded
+        || opts->dedup_window > 0
+        || opts->checkpoint_interval > 0.0 || opts->resume
+        || opts->binary_input || opts->all_users
+        || opts->page_users_mmap_file != NULL) {
+      fprintf(stderr, "--stream cannot be combined with other input,"
+              " sharding, batching, checkpointing, or --top options\n");
+      return 0;
+    }
+    if (opts->stream_interval == 0.0) {
+      opts->stream_interval = DEFAULT_STREAM_INTERVAL;
+    }
+    return 1;
+  } else if (opts->stream_interval > 0.0 || opts->half_life > 0.0) {
+    fprintf(stderr, "--stream-interval and --half-life need --stream\n");
+    return 0;
+  }
+  if (strcmp(opts->userids_file, "_") == 0) {
+    opts->all_users = 1;
+  }
+  if (opts->all_users && opts->binary_input) {
+    fprintf(stderr, "--binary-input needs a userids_file\n");
+    return 0;
+  }
+  if (opts->page_users_mmap_file != NULL
+      && (opts->all_users || opts->binary_input)) {
+    fprintf(stderr, "--pages needs a text list of pageids\n");
+    return 0;
+  }
+  // Replicas are copied into memory up front, and the workers do not
+  // read the mappings the prefetcher would advise.
+  if (opts->prefetch_depth > 0 && opts->numa_replicate) {
+    fprintf(stderr, "--prefetch cannot be combined with"
+            " --numa-replicate\n");
+    return 0;
+  }
+  if (opts->compare_precision && opts->precision == PRECISION_DOUBLE) {
+    fprintf(stderr, "--compare-precision needs --precision float or"
+            " uint16\n");
+    return 0;
+  }
+  if (opts->precision != PRECISION_DOUBLE) {
+    opts->fused = 1;
+  }
+  if (opts->fused && (opts->batch_window > 0 || opts->multi_metric)) {
+    fprintf(stderr, "--engine fused and --precision cannot be combined"
+            " with --batch or --metric cosine+jsd\n");
+    return 0;
+  }
+  if (opts->multi_metric && opts->batch_window > 0) {
+    fprintf(stderr, "--batch does not support --metric cosine+jsd\n");
+    return 0;
+  }
+  if (opts->top_n > 0
+      && (opts->batch_window > 0 || opts->multi_metric
+          || opts->checkpoint_interval > 0.0 || opts->resume
+          || opts->dedup_window > 0)) {
+    fprintf(stderr, "--top cannot be combined with --batch, --dedup,"
+            " --checkpoint, --resume, or --metric cosine+jsd\n");
+    return 0;
+  }
+  if (opts->resume && opts->checkpoint_interval == 0.0) {
+    opts->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+  }
+  return 1;
+}
+
+double elapsed_seconds(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec)
+      + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+struct node_queues {
+  struct queue **queues;
+  int num_queues;
+  /* If not NULL, work passes through the prefetcher's queue first. */
+  struct queue *prefetch_queue;
+};
+
+/* Push to the least loaded node queue, so that a slow node does not
+   block the reader while other nodes sit idle. */
+void dispatch_to_nodes(struct user_group *work, void *context) {
+  struct node_queues *nq = context;
+  struct queue *best = nq->queues[0];
+  int best_size = nq->num_queues > 1 ? queue_size(best) : 0;
+  for (int i = 1; i < nq->num_queues; ++i) {
+    int size = queue_size(nq->queues[i]);
+    if (size < best_size) {
+      best = nq->queues[i];
+      best_size = size;
+    }
+  }
+  push_back(best, work);
+}
+
+void dispatch_work(struct user_group *work, void *context) {
+  struct node_queues *nq = context;
+  if (nq->prefetch_queue != NULL) {
+    push_back(nq->prefetch_queue, work);
+  } else {
+    dispatch_to_nodes(work, nq);
+  }
+}
+
+/* Where items go once deduplicated: to the batcher if batching,
+   otherwise to the workers. */
+struct work_router {
+  struct batcher *batcher;
+  struct node_queues *queues;
+};
+
+void route_work(struct user_group *work, void *context) {
+  struct work_router *router = context;
+  if (router->batcher != NULL) {
+    batcher_add(router->batcher, work, dispatch_work, router->queues);
+  } else {
+    dispatch_work(work, router->queues);
+  }
+}
+
+struct bounded_item {
+  double bound;
+  struct user_group *work;
+};
+
+/* Highest bound first, then input order. */
+int compare_bounds(const void *a, const void *b) {
+  const struct bounded_item *first = a;
+  const struct bounded_item *second = b;
+  if (first->bound != second->bound) {
+    return first->bound > second->bound ? -1 : 1;
+  }
+  return first->work->sequence < second->work->sequence ? -1 : 1;
+}
+
+/* Dispatch items in descending order of their CC upper bounds until
+   none of the rest can enter the top results. Returns the number of
+   items dispatched. */
+int64_t dispatch_top_items(struct bounded_item *items, int64_t num_items,
+                           struct top_results *top,
+                           struct node_queues *queues) {
+  qsort(items, num_items, sizeof(struct bounded_item), compare_bounds);
+  int64_t num_dispatched = 0;
+  for (int64_t i = 0; i < num_items; ++i) {
+    if (!top_can_enter(top, items[i].bound)) {
+      // Bounds only decrease from here.
+      for (int64_t j = i; j < num_items; ++j) {
+        free(items[j].work->userids);
+        free(items[j].work);
+      }
+      break;
+    }
+    dispatch_work(items[i].work, queues);
+    ++num_dispatched;
+  }
+  return num_dispatched;
+}
 
-#define BUFFER_SIZE 10000
+/* Apply events as they arrive, handing changed users to the workers
+   once per interval, until the stream ends. */
+void run_stream(struct stream_state *stream, double interval,
+                struct node_queues *queues) {
+  double next_flush = monotonic_seconds() + interval;
+  int open = 1;
+  while (open) {
+    open = read_stream_events(stream, next_flush - monotonic_seconds());
+    double now = monotonic_seconds();
+    if (now >= next_flush || !open) {
+      flush_stream(stream, dispatch_work, queues);
+      next_flush = now + interval;
+    }
+  }
+}
 
 int main(int argc, char **argv) {
-  if (argc != 6) {
-    printf("Usage: %s users_mmap pages_mmap controversy_mmap"
-           " userids_file num_threads\n", argv[0]);
+  struct cc_options opts;
+  if (!parse_options(argc, argv, &opts)) {
+    print_usage(argv[0]);
     return 1;
   }
+  struct timespec start_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
   int user_mmapfd, page_mmapfd, controversy_mmapfd;
-  const char *user_mmap = open_mmap_read(argv[1], &user_mmapfd);
-  const char *page_mmap = open_mmap_read(argv[2], &page_mmapfd);
-  const char *controversy_mmap = open_mmap_read(argv[3],
+  const char *user_mmap = open_mmap_read(opts.users_mmap_file,
+                                         &user_mmapfd);
+  const char *page_mmap = open_mmap_read(opts.pages_mmap_file,
+                                         &page_mmapfd);
+  const char *controversy_mmap = open_mmap_read(opts.controversy_mmap_file,
                                                 &controversy_mmapfd);
   int64_t num_users;
   const struct mmap_item *users = get_items(user_mmap, &num_users);
-  int64_t num_pages;
-  const struct mmap_item *pages = get_items(page_mmap, &num_pages);
-  int64_t num_controversy;
-  const struct mmap_feature *controversy = get_top_level_features(
-      controversy_mmap, &num_controversy);
-  struct queue *work_queue = init_queue(100);
-  int num_threads = atoi(argv[5]);
+  int num_threads = opts.num_threads;
+  int num_outputs = opts.multi_metric ? MAX_OUTPUTS : JSD_CC_OUTPUT;
+
+  static char shard_prefix[64];
+  if (opts.sharded) {
+    init_shard_ranges(&opts.shard, users, num_users);
+    if (opts.output_prefix == NULL) {
+      snprintf(shard_prefix, sizeof(shard_prefix), "shard%d_",
+               opts.shard.index);
+      opts.output_prefix = shard_prefix;
+    }
+    if (opts.shard.by_hash) {
+      fprintf(stderr, "Shard %d/%d: assigned by userid hash\n",
+              opts.shard.index, opts.shard.count);
+    } else {
+      fprintf(stderr, "Shard %d/%d: userids [%" PRId64 ", %" PRId64 ")"
+              ", %.1f%% of estimated cost\n",
+              opts.shard.index, opts.shard.count,
+              opts.shard.first_userid,
+              opts.shard.end_userid < num_users
+              ? opts.shard.end_userid : num_users,
+              100.0 * opts.shard.cost_share);
+    }
+  }
+  if (opts.output_prefix == NULL) {
+    opts.output_prefix = "";
+  }
+
+  // Recover the completed items of the previous run from the checkpoint
+  // logs of every thread it used, which may be more than we use now.
+  struct completed_items completed;
+  memset(&completed, 0, sizeof(completed));
+  if (opts.resume) {
+    char checkpoint_file[FILE_NAME_SIZE];
+    char output_files[MAX_OUTPUTS][FILE_NAME_SIZE];
+    const char *output_names[MAX_OUTPUTS];
+    for (int i = 0; i < num_outputs; ++i) {
+      output_names[i] = output_files[i];
+    }
+    for (int i = 0; ; ++i) {
+      snprintf(checkpoint_file, FILE_NAME_SIZE, "%scheckpoint_%d",
+               opts.output_prefix, i);
+      output_file_names(output_files, opts.output_prefix, i, num_outputs);
+      if (!load_checkpoint(checkpoint_file, output_names, num_outputs,
+                           &completed)
+          && i >= num_threads) {
+        break;
+      }
+    }
+    fprintf(stderr, "Resuming: %" PRId64 " items already completed\n",
+            completed.count);
+  }
+
+  struct numa_topology topology;
+  int num_nodes = 1;
+  if (opts.numa) {
+    read_numa_topology(&topology);
+    num_nodes = topology.num_nodes;
+    if (num_nodes > num_threads) {
+      num_nodes = num_threads;
+    }
+  }
+  // A compressed pages_mmap is read through one cache shared by every
+  // thread, which holds its decompressed blocks.
+  struct block_cache page_cache;
+  int compressed_pages = get_block_store(page_mmap) != NULL;
+  if (compressed_pages) {
+    init_block_cache(&page_cache, page_mmap, opts.page_cache_size);
+  }
+  // Per-node copies of the read-only maps. Without replication every
+  // node shares the original mapping. The page cache reads the original
+  // mapping, so a compressed pages_mmap is not replicated.
+  int replicate_pages = opts.numa_replicate && !compressed_pages;
+  const char **node_page_mmap = malloc(num_nodes * sizeof(char*));
+  const char **node_controversy_mmap = malloc(num_nodes * sizeof(char*));
+  int64_t page_mmap_size = get_mmap_size(page_mmapfd);
+  int64_t controversy_mmap_size = get_mmap_size(controversy_mmapfd);
+  for (int node = 0; node < num_nodes; ++node) {
+    node_page_mmap[node] = replicate_pages
+        ? replicate_on_node(&topology, node, page_mmap, page_mmap_size)
+        : page_mmap;
+    node_controversy_mmap[node] = opts.numa_replicate
+        ? replicate_on_node(&topology, node, controversy_mmap,
+                            controversy_mmap_size)
+        : controversy_mmap;
+  }
+  struct queue **work_queues = malloc(num_nodes * sizeof(struct queue*));
+  for (int node = 0; node < num_nodes; ++node) {
+    // With prefetching, the queue length is the lookahead depth.
+    work_queues[node] = init_queue(opts.prefetch_depth > 0
+                                   ? opts.prefetch_depth : QUEUE_SIZE);
+  }
+  int *thread_node = malloc(num_threads * sizeof(int));
   struct thread_info *threads = (struct thread_info*)malloc(
       num_threads * sizeof(struct thread_info));
+  struct top_results top;
+  if (opts.top_n > 0) {
+    init_top_results(&top, opts.top_n);
+  }
+  struct memory_budget budget;
+  if (opts.memory_budget > 0) {
+    init_memory_budget(&budget, opts.memory_budget);
+  }
   pthread_t *pths = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
-  
+
   for (int i = 0; i < num_threads; ++i) {
+    // Threads are split into contiguous blocks, one block per node.
+    int node = (int)((int64_t)i * num_nodes / num_threads);
+    thread_node[i] = node;
     struct thread_info *tinfo = threads + i;
-    tinfo->mmap_pages = page_mmap;
-    tinfo->pages = pages;
+    int64_t num_pages;
+    tinfo->mmap_pages = node_page_mmap[node];
+    tinfo->pages = get_items(tinfo->mmap_pages, &num_pages);
     tinfo->num_pages = num_pages;
-    
+
     tinfo->mmap_users = user_mmap;
     tinfo->users = users;
     tinfo->num_users = num_users;
-    
-    tinfo->controversy = controversy;
+
+    int64_t num_controversy;
+    tinfo->controversy = get_top_level_features(
+        node_controversy_mmap[node], &num_controversy);
     tinfo->num_controversy = num_controversy;
-    
-    tinfo->input_queue = work_queue;
-    sprintf(tinfo->cc_output_file, "scores_out_%d", i);
-    sprintf(tinfo->c_output_file, "raw_page_stats_out_%d", i);
-    pthread_create(pths + i, NULL, generate_scores, threads + i);
-  }
-  FILE *input_file = fopen(argv[4], "r");
-  assert(input_file);
-  char line_buffer[BUFFER_SIZE];
-  char *s;
-  int64_t userid;
-  while (fgets(line_buffer, BUFFER_SIZE, input_file) != NULL) {
-    num_users = 0;
-    s = line_buffer;
-    char *last_end = NULL;
-    // Count the number of users on this line
-    for (s = strtok(s, " "); s != NULL; s = strtok(NULL, " ")) {
-      if (strlen(s) == 0 || s[0] == '\n') {
-        continue;
-      }
-      ++num_users;
-      if (last_end != NULL) {
-        *last_end = ' ';
+
+    tinfo->input_queue = work_queues[node];
+    tinfo->num_outputs = num_outputs;
+    output_file_names(tinfo->output_files, opts.output_prefix, i,
+                      num_outputs);
+    tinfo->checkpoint_file[0] = '\0';
+    if (opts.checkpoint_interval > 0.0) {
+      snprintf(tinfo->checkpoint_file, FILE_NAME_SIZE, "%scheckpoint_%d",
+               opts.output_prefix, i);
+    }
+    tinfo->checkpoint_interval = opts.checkpoint_interval;
+    tinfo->resume = opts.resume;
+    tinfo->metric = opts.metric;
+    tinfo->multi_metric = opts.multi_metric;
+    tinfo->fused = opts.fused;
+    tinfo->precision = opts.precision;
+    tinfo->compare_precision = opts.compare_precision;
+    tinfo->top = opts.top_n > 0 ? &top : NULL;
+    tinfo->budget = opts.memory_budget > 0 ? &budget : NULL;
+    tinfo->page_cache = compressed_pages ? &page_cache : NULL;
+    tinfo->no_raw_page_stats = opts.no_raw_page_stats;
+    tinfo->aggregate_pages = opts.page_aggregates;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (opts.numa) {
+      int first_thread = (int)(((int64_t)node * num_threads
+                                + num_nodes - 1) / num_nodes);
+      int slot = i - first_thread;
+      set_thread_cpu(&attr, topology.cpus[node][
+          slot % topology.num_cpus[node]]);
+    }
+    pthread_create(pths + i, &attr, generate_scores, threads + i);
+    pthread_attr_destroy(&attr);
+  }
+  int64_t num_items = 0;
+  struct node_queues dispatch_queues;
+  dispatch_queues.queues = work_queues;
+  dispatch_queues.num_queues = num_nodes;
+  dispatch_queues.prefetch_queue = NULL;
+  struct prefetcher prefetcher;
+  pthread_t prefetch_thread;
+  if (opts.prefetch_depth > 0) {
+    dispatch_queues.prefetch_queue = init_queue(QUEUE_SIZE);
+    init_prefetcher(&prefetcher, user_mmap, users, num_users, page_mmap,
+                    page_mmap_size, dispatch_queues.prefetch_queue,
+                    dispatch_to_nodes, &dispatch_queues);
+    pthread_create(&prefetch_thread, NULL, run_prefetcher, &prefetcher);
+  }
+  struct batcher batcher;
+  if (opts.batch_window > 0) {
+    init_batcher(&batcher, opts.batch_window, user_mmap, users, num_users);
+  }
+  struct work_router router;
+  router.batcher = opts.batch_window > 0 ? &batcher : NULL;
+  router.queues = &dispatch_queues;
+  struct deduper deduper;
+  if (opts.dedup_window > 0) {
+    init_deduper(&deduper, opts.dedup_window, user_mmap, users, num_users);
+  }
+  int64_t num_candidates = 0;
+  struct stream_state stream;
+  if (opts.stream) {
+    int64_t num_pages = threads[0].num_pages < threads[0].num_controversy
+        ? threads[0].num_pages : threads[0].num_controversy;
+    init_stream(&stream, opts.userids_file, user_mmap, users, num_users,
+                num_pages, opts.half_life);
+    run_stream(&stream, opts.stream_interval, &dispatch_queues);
+    num_items = stream.num_rescores;
+  } else {
+    struct input_reader input;
+    if (opts.all_users) {
+      int64_t first_userid = 0;
+      int64_t end_userid = num_users;
+      if (opts.sharded && !opts.shard.by_hash) {
+        first_userid = opts.shard.first_userid;
+        if (opts.shard.end_userid < end_userid) {
+          end_userid = opts.shard.end_userid;
+        }
       }
-      last_end = s + strlen(s);
+      open_all_users_input(&input, users, first_userid, end_userid);
+    } else if (opts.page_users_mmap_file != NULL) {
+      open_page_users_input(&input, opts.userids_file,
+                            opts.page_users_mmap_file, num_users);
+      fprintf(stderr, "Pages: %" PRId64 " pages edited by %" PRId64 " users\n",
+              input.num_query_pages, input.num_selected_users);
+    } else if (opts.binary_input) {
+      open_binary_input(&input, opts.userids_file);
+    } else {
+      open_text_input(&input, opts.userids_file);
     }
-    if (num_users == 0) {
-      continue;
+    // In top-N mode every item is read and bounded before any is
+    // dispatched.
+    struct bounded_item *bounded_items = NULL;
+    int64_t max_bounded_items = 0;
+    const struct mmap_feature *controversy = NULL;
+    int64_t num_controversy = 0;
+    if (opts.top_n > 0) {
+      controversy = get_top_level_features(controversy_mmap, &num_controversy);
     }
-    // Allocate space for the users and read them in
-    struct user_group *work = malloc(sizeof(struct user_group));
-    work->num_users = num_users;
-    work->userids = malloc(sizeof(int64_t) * num_users);
-    s = line_buffer;
-    int i = 0;
-    for (s = strtok(s, " "); s != NULL; s = strtok(NULL, " ")) {
-      if (strlen(s) == 0 || s[0] == '\n') {
+    struct user_group *work;
+    while ((work = next_input_group(&input)) != NULL) {
+      if (item_completed(&completed, work->sequence)
+          || (opts.sharded && !shard_owns_group(&opts.shard, work->userids,
+                                                work->num_users))) {
+        free(work->userids);
+        free(work);
         continue;
       }
-      userid = atol(s);
-      work->userids[i] = userid;
-      ++i;
+      // Send this work unit to the worker threads
+      if (opts.top_n > 0) {
+        if (num_items == max_bounded_items) {
+          max_bounded_items = max_bounded_items > 0
+              ? 2 * max_bounded_items : 1024;
+          bounded_items = realloc(
+              bounded_items, max_bounded_items * sizeof(struct bounded_item));
+        }
+        work->cc_bound = cc_upper_bound(work, user_mmap, users, num_users,
+                                        controversy, num_controversy);
+        bounded_items[num_items].bound = work->cc_bound;
+        bounded_items[num_items].work = work;
+      } else if (opts.dedup_window > 0) {
+        deduper_add(&deduper, work, route_work, &router);
+      } else {
+        route_work(work, &router);
+      }
+      ++num_items;
+    }
+    if (input.num_malformed_lines > 0) {
+      fprintf(stderr, "Input: skipped %" PRId64 " malformed lines\n",
+              input.num_malformed_lines);
+    }
+    close_input(&input);
+    num_candidates = num_items;
+    if (opts.top_n > 0) {
+      num_items = dispatch_top_items(bounded_items, num_candidates, &top,
+                                     &dispatch_queues);
+      free(bounded_items);
+    }
+    if (opts.dedup_window > 0) {
+      deduper_flush(&deduper, route_work, &router);
+    }
+    if (opts.batch_window > 0) {
+      batcher_flush(&batcher, dispatch_work, &dispatch_queues);
     }
-    // Send this work unit to the worker threads
-    push_back(work_queue, work);
+  }
+  if (opts.prefetch_depth > 0) {
+    push_back(dispatch_queues.prefetch_queue, NULL);
+    pthread_join(prefetch_thread, NULL);
   }
   // Tell each thread that there's no more data.
   for (int i = 0; i < num_threads; ++i) {
-    push_back(work_queue, NULL);
+    push_back(work_queues[thread_node[i]], NULL);
   }
+  int64_t pair_count = 0;
+  int64_t sim_evaluations = 0;
+  int64_t merge_work = 0;
+  int64_t merge_work_unshared = 0;
+  int64_t num_latencies = 0;
+  double latency_sum = 0.0;
+  double latency_max = 0.0;
+  int64_t num_fused = 0;
+  int64_t num_pruned = 0;
+  struct precision_deviation deviation;
+  memset(&deviation, 0, sizeof(deviation));
+  int64_t major_faults = 0;
+  int64_t arena_chunks = 0;
+  size_t arena_peak = 0;
   for (int i = 0; i < num_threads; ++i) {
     pthread_join(pths[i], NULL);
+    pair_count += threads[i].pair_count;
+    sim_evaluations += threads[i].sim_evaluations;
+    merge_work += threads[i].merge_work;
+    num_pruned += threads[i].num_pruned;
+    merge_work_unshared += threads[i].merge_work_unshared;
+    num_latencies += threads[i].num_latencies;
+    latency_sum += threads[i].latency_sum;
+    if (threads[i].latency_max > latency_max) {
+      latency_max = threads[i].latency_max;
+    }
+    num_fused += threads[i].num_fused;
+    const struct precision_deviation *d = &threads[i].deviation;
+    deviation.num_items += d->num_items;
+    deviation.cc_sum += d->cc_sum;
+    deviation.cc_max = fmax(deviation.cc_max, d->cc_max);
+    deviation.clustering_sum += d->clustering_sum;
+    deviation.clustering_max = fmax(deviation.clustering_max,
+                                    d->clustering_max);
+    deviation.num_pages += d->num_pages;
+    deviation.page_clustering_sum += d->page_clustering_sum;
+    deviation.page_clustering_max = fmax(deviation.page_clustering_max,
+                                         d->page_clustering_max);
+    major_faults += threads[i].major_faults;
+    arena_chunks += threads[i].arena_chunks;
+    if (threads[i].arena_peak > arena_peak) {
+      arena_peak = threads[i].arena_peak;
+    }
+  }
+  num_items -= num_pruned;
+  double seconds = elapsed_seconds(&start_time);
+  fprintf(stderr,
+          "Scored %" PRId64 " items in %.3f s (%.1f items/s)"
+          " with %d threads on %d node(s)%s\n",
+          num_items, seconds, num_items / seconds, num_threads, num_nodes,
+          opts.numa_replicate ? ", replicated maps"
+          : (opts.numa ? ", pinned" : ""));
+  fprintf(stderr,
+          "Scratch memory: %" PRId64 " allocations for %" PRId64 " items,"
+          " at most %.1f MB per item\n",
+          arena_chunks, num_items, arena_peak / 1048576.0);
+  if (opts.batch_window > 0) {
+    fprintf(stderr,
+            "Batching: %" PRId64 " users in %" PRId64 " batches;"
+            " %.1f similarity evaluations per item (%.1f unbatched),"
+            " %.1f%% fewer\n",
+            batcher.num_batched_users, batcher.num_batches,
+            num_items > 0 ? (double)sim_evaluations / num_items : 0.0,
+            num_items > 0 ? (double)pair_count / num_items : 0.0,
+            pair_count > 0
+            ? 100.0 * (pair_count - sim_evaluations) / pair_count : 0.0);
+    if (merge_work_unshared > 0) {
+      fprintf(stderr,
+              "Group chains: %" PRId64 " groups in %" PRId64 " chains;"
+              " merge work %.1f per item (%.1f without shared cores),"
+              " %.1f%% less\n",
+              batcher.num_chained_groups, batcher.num_chains,
+              (double)merge_work / num_items,
+              (double)merge_work_unshared / num_items,
+              100.0 * (merge_work_unshared - merge_work)
+              / merge_work_unshared);
+    }
+    free_batcher(&batcher);
+  }
+  if (opts.dedup_window > 0) {
+    fprintf(stderr,
+            "Dedup: %" PRId64 " of %" PRId64 " items shared another"
+            " item's page vector and were not scored again (%.1f%%)\n",
+            deduper.num_duplicates, num_items,
+            num_items > 0 ? 100.0 * deduper.num_duplicates / num_items
+            : 0.0);
+    free_deduper(&deduper);
+  }
+  fprintf(stderr, "Major page faults in workers: %" PRId64 "\n",
+          major_faults);
+  if (opts.prefetch_depth > 0) {
+    fprintf(stderr,
+            "Prefetch: %" PRId64 " items, %.1f MB advised,"
+            " %" PRId64 " non-resident pages read ahead of the workers\n",
+            prefetcher.num_items, prefetcher.bytes_advised / 1048576.0,
+            prefetcher.pages_missing);
+    free_prefetcher(&prefetcher);
+    free_queue(dispatch_queues.prefetch_queue);
+  }
+  if (opts.page_aggregates) {
+    // Sum the threads' accumulators into the first thread's.
+    struct page_aggregate *aggregates = threads[0].page_aggregates;
+    int64_t num_pages = threads[0].num_controversy;
+    for (int i = 1; i < num_threads; ++i) {
+      merge_page_stats(aggregates, threads[i].page_aggregates, num_pages);
+      free(threads[i].page_aggregates);
+    }
+    int64_t pages_touched = 0;
+    int64_t page_entries = 0;
+    for (int64_t i = 0; i < num_pages; ++i) {
+      pages_touched += aggregates[i].num_items > 0;
+      page_entries += aggregates[i].num_items;
+    }
+    char page_stats_file[FILE_NAME_SIZE];
+    snprintf(page_stats_file, FILE_NAME_SIZE, "%spage_stats_mmap",
+             opts.output_prefix);
+    write_page_stats(page_stats_file, aggregates, num_pages);
+    fprintf(stderr,
+            "Page aggregates: %" PRId64 " pages in %" PRId64 " item-page"
+            " entries, written to %s\n",
+            pages_touched, page_entries, page_stats_file);
+    free(aggregates);
+  }
+  if (compressed_pages) {
+    int64_t hits, misses, evictions, peak_bytes;
+    block_cache_stats(&page_cache, &hits, &misses, &evictions, &peak_bytes);
+    fprintf(stderr,
+            "Page cache: %.1f%% of %" PRId64 " block lookups hit,"
+            " %" PRId64 " blocks decompressed, %" PRId64 " evicted;"
+            " peak %.1f MB of %.1f MB\n",
+            hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+            hits + misses, misses, evictions, peak_bytes / 1048576.0,
+            opts.page_cache_size / 1048576.0);
+    free_block_cache(&page_cache);
+  }
+  if (num_fused > 0) {
+    fprintf(stderr, "Fused engine: %" PRId64 " items, %s edges\n",
+            num_fused, precision_name(opts.precision));
+  }
+  if (deviation.num_items > 0) {
+    fprintf(stderr,
+            "Precision: %s vs double over %" PRId64 " items;"
+            " CC max %.3e mean %.3e, clustering max %.3e mean %.3e,"
+            " page clustering max %.3e mean %.3e\n",
+            precision_name(opts.precision), deviation.num_items,
+            deviation.cc_max, deviation.cc_sum / deviation.num_items,
+            deviation.clustering_max,
+            deviation.clustering_sum / deviation.num_items,
+            deviation.page_clustering_max,
+            deviation.num_pages > 0
+            ? deviation.page_clustering_sum / deviation.num_pages : 0.0);
+  }
+  if (opts.memory_budget > 0) {
+    fprintf(stderr,
+            "Memory budget: peak reserved %.1f MB of %.1f MB;"
+            " %" PRId64 " items waited for memory\n",
+            budget.peak / 1048576.0, budget.budget / 1048576.0,
+            budget.num_waits);
+    free_memory_budget(&budget);
+  }
+  if (opts.stream) {
+    fprintf(stderr,
+            "Stream: %" PRId64 " events (%" PRId64 " malformed),"
+            " %" PRId64 " rescores (%.1f/s),"
+            " event-to-score latency mean %.3f s, max %.3f s\n",
+            stream.num_events, stream.num_bad_events, stream.num_rescores,
+            stream.num_rescores / seconds,
+            num_latencies > 0 ? latency_sum / num_latencies : 0.0,
+            latency_max);
+    free_stream(&stream);
+  }
+  if (opts.top_n > 0) {
+    char top_scores_file[FILE_NAME_SIZE];
+    char top_page_stats_file[FILE_NAME_SIZE];
+    snprintf(top_scores_file, FILE_NAME_SIZE, "%stop_scores_out",
+             opts.output_prefix);
+    snprintf(top_page_stats_file, FILE_NAME_SIZE,
+             "%stop_raw_page_stats_out", opts.output_prefix);
+    FILE *top_scores_out = fopen(top_scores_file, "w");
+    FILE *top_page_stats_out = fopen(top_page_stats_file, "w");
+    assert(top_scores_out && top_page_stats_out);
+    write_top_results(&top, top_scores_out, top_page_stats_out);
+    fclose(top_scores_out);
+    fclose(top_page_stats_out);
+    fprintf(stderr,
+            "Top %d: scored %" PRId64 " of %" PRId64 " candidates,"
+            " %.1f%% pruned by bound (%" PRId64 " by workers)\n",
+            opts.top_n, num_items, num_candidates,
+            num_candidates > 0
+            ? 100.0 * (num_candidates - num_items) / num_candidates : 0.0,
+            num_pruned);
+    free_top_results(&top);
+  }
+  for (int node = 0; node < num_nodes; ++node) {
+    if (replicate_pages) {
+      free_replica(node_page_mmap[node], page_mmap_size);
+    }
+    if (opts.numa_replicate) {
+      free_replica(node_controversy_mmap[node], controversy_mmap_size);
+    }
+    free_queue(work_queues[node]);
+  }
+  if (opts.numa) {
+    free_numa_topology(&topology);
   }
+  free(node_page_mmap);
+  free(node_controversy_mmap);
+  free(work_queues);
+  free(thread_node);
+  free_completed_items(&completed);
   free(threads);
   free(pths);
-  free_queue(work_queue);
   return 0;
 }
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC 0x63636b7074303031LL
+#define INITIAL_PENDING 1024
+#define MAX_RECORD_ITEMS (1LL << 32)
+
+struct checkpoint_record {
+  int64_t magic;
+  int64_t count;
+  int64_t num_outputs;
+  // Followed by num_outputs output sizes, count sequence numbers, and
+  // a checksum of everything before it.
+};
+
+static uint64_t checksum_update(uint64_t hash, const void *data,
+                                size_t length) {
+  // FNV-1a
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+static double now_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void sync_file(FILE *fp) {
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+    fprintf(stderr, "Could not sync output: %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+void init_checkpoint(struct checkpoint_writer *writer, const char *file_name,
+                     double interval, int resume,
+                     FILE **outputs, int num_outputs) {
+  assert(num_outputs <= MAX_CHECKPOINT_OUTPUTS);
+  memcpy(writer->outputs, outputs, num_outputs * sizeof(FILE*));
+  writer->num_outputs = num_outputs;
+  writer->log = fopen(file_name, resume ? "ab" : "wb");
+  if (writer->log == NULL) {
+    fprintf(stderr, "Could not open checkpoint log %s\n", file_name);
+    exit(1);
+  }
+  writer->max_pending = INITIAL_PENDING;
+  writer->pending = malloc(writer->max_pending * sizeof(int64_t));
+  writer->num_pending = 0;
+  writer->interval = interval;
+  writer->last_commit = now_seconds();
+}
+
+void checkpoint_commit(struct checkpoint_writer *writer) {
+  if (writer->num_pending == 0) {
+    return;
+  }
+  int64_t offsets[MAX_CHECKPOINT_OUTPUTS];
+  for (int i = 0; i < writer->num_outputs; ++i) {
+    sync_file(writer->outputs[i]);
+    offsets[i] = ftello(writer->outputs[i]);
+  }
+  struct checkpoint_record record;
+  record.magic = CHECKPOINT_MAGIC;
+  record.count = writer->num_pending;
+  record.num_outputs = writer->num_outputs;
+  uint64_t checksum = checksum_update(CHECKSUM_INIT, &record,
+                                      sizeof(record));
+  checksum = checksum_update(checksum, offsets,
+                             writer->num_outputs * sizeof(int64_t));
+  checksum = checksum_update(checksum, writer->pending,
+                             writer->num_pending * sizeof(int64_t));
+  fwrite(&record, sizeof(record), 1, writer->log);
+  fwrite(offsets, sizeof(int64_t), writer->num_outputs, writer->log);
+  fwrite(writer->pending, sizeof(int64_t), writer->num_pending,
+         writer->log);
+  fwrite(&checksum, sizeof(checksum), 1, writer->log);
+  sync_file(writer->log);
+  writer->num_pending = 0;
+  writer->last_commit = now_seconds();
+}
+
+void checkpoint_item_done(struct checkpoint_writer *writer, int64_t seq) {
+  if (writer->num_pending == writer->max_pending) {
+    writer->max_pending *= 2;
+    writer->pending = realloc(writer->pending,
+                              writer->max_pending * sizeof(int64_t));
+  }
+  writer->pending[writer->num_pending++] = seq;
+  if (now_seconds() - writer->last_commit >= writer->interval) {
+    checkpoint_commit(writer);
+  }
+}
+
+void close_checkpoint(struct checkpoint_writer *writer) {
+  checkpoint_commit(writer);
+  fclose(writer->log);
+  writer->log = NULL;
+  free(writer->pending);
+  writer->pending = NULL;
+}
+
+static void mark_completed(struct completed_items *completed, int64_t seq) {
+  assert(seq >= 0);
+  if (seq >= completed->num_bits) {
+    int64_t num_bits = completed->num_bits == 0 ? 8192
+        : completed->num_bits;
+    while (num_bits <= seq) {
+      num_bits *= 2;
+    }
+    completed->bits = realloc(completed->bits, num_bits / 8);
+    memset(completed->bits + completed->num_bits / 8, 0,
+           (num_bits - completed->num_bits) / 8);
+    completed->num_bits = num_bits;
+  }
+  if (!(completed->bits[seq / 8] & (1 << (seq % 8)))) {
+    completed->bits[seq / 8] |= 1 << (seq % 8);
+    ++completed->count;
+  }
+}
+
+int item_completed(const struct completed_items *completed, int64_t seq) {
+  if (seq >= completed->num_bits) {
+    return 0;
+  }
+  return (completed->bits[seq / 8] >> (seq % 8)) & 1;
+}
+
+void free_completed_items(struct completed_items *completed) {
+  free(completed->bits);
+  completed->bits = NULL;
+  completed->num_bits = 0;
+  completed->count = 0;
+}
+
+static void truncate_output(const char *file_name, int64_t size) {
+  struct stat statbuf;
+  if (stat(file_name, &statbuf) == 0 && statbuf.st_size < size) {
+    fprintf(stderr, "%s is shorter than its checkpoint, cannot resume\n",
+            file_name);
+    exit(1);
+  }
+  if (truncate(file_name, size) != 0 && !(errno == ENOENT && size == 0)) {
+    fprintf(stderr, "Could not truncate %s to %" PRId64 " bytes: %s\n",
+            file_name, size, strerror(errno));
+    exit(1);
+  }
+}
+
+int load_checkpoint(const char *file_name, const char **output_files,
+                    int num_outputs, struct completed_items *completed) {
+  assert(num_outputs <= MAX_CHECKPOINT_OUTPUTS);
+  int64_t valid_offsets[MAX_CHECKPOINT_OUTPUTS];
+  memset(valid_offsets, 0, sizeof(valid_offsets));
+  FILE *log = fopen(file_name, "rb");
+  if (log == NULL) {
+    for (int i = 0; i < num_outputs; ++i) {
+      truncate_output(output_files[i], 0);
+    }
+    return 0;
+  }
+  struct checkpoint_record record;
+  int64_t offsets[MAX_CHECKPOINT_OUTPUTS];
+  int64_t valid_end = 0;
+  int64_t *seqs = NULL;
+  int64_t max_seqs = 0;
+  while (fread(&record, sizeof(record), 1, log) == 1) {
+    if (record.magic != CHECKPOINT_MAGIC || record.count <= 0
+        || record.count > MAX_RECORD_ITEMS) {
+      break;
+    }
+    if (record.num_outputs != num_outputs) {
+      fprintf(stderr, "%s was written with %" PRId64 " outputs per thread"
+              " rather than %d; use the same options to resume\n",
+              file_name, record.num_outputs, num_outputs);
+      exit(1);
+    }
+    if (fread(offsets, sizeof(int64_t), num_outputs, log)
+        != (size_t)num_outputs) {
+      break;
+    }
+    if (record.count > max_seqs) {
+      max_seqs = record.count;
+      seqs = realloc(seqs, max_seqs * sizeof(int64_t));
+    }
+    uint64_t stored_checksum;
+    if (fread(seqs, sizeof(int64_t), record.count, log)
+        != (size_t)record.count
+        || fread(&stored_checksum, sizeof(stored_checksum), 1, log) != 1) {
+      break;
+    }
+    uint64_t checksum = checksum_update(CHECKSUM_INIT, &record,
+                                        sizeof(record));
+    checksum = checksum_update(checksum, offsets,
+                               num_outputs * sizeof(int64_t));
+    checksum = checksum_update(checksum, seqs,
+                               record.count * sizeof(int64_t));
+    if (checksum != stored_checksum) {
+      break;
+    }
+    for (int64_t i = 0; i < record.count; ++i) {
+      mark_completed(completed, seqs[i]);
+    }
+    memcpy(valid_offsets, offsets, num_outputs * sizeof(int64_t));
+    valid_end = ftello(log);
+  }
+  free(seqs);
+  fclose(log);
+  // Drop any partially written record so new records follow the last
+  // intact one.
+  truncate_output(file_name, valid_end);
+  for (int i = 0; i < num_outputs; ++i) {
+    truncate_output(output_files[i], valid_offsets[i]);
+  }
+  return 1;
+}
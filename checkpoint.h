@@ -0,0 +1,59 @@
+/* Checkpointing of completed work items so an interrupted cc_mmap run
+   can be resumed. Each worker thread appends records to its own
+   checkpoint log. A record lists the input sequence numbers of the
+   items finished since the previous record, together with the sizes of
+   the thread's output files after those items were written and
+   fsync'd. On resume, outputs are truncated back to the last recorded
+   sizes (dropping partial trailing records and items written after the
+   last checkpoint) and every recorded item is skipped. */
+
+#ifndef __checkpoint_h__
+#define __checkpoint_h__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define MAX_CHECKPOINT_OUTPUTS 8
+
+struct checkpoint_writer {
+  FILE *log;
+  /* The thread's output files, whose sizes are recorded. */
+  FILE *outputs[MAX_CHECKPOINT_OUTPUTS];
+  int num_outputs;
+  int64_t *pending;
+  int num_pending;
+  int max_pending;
+  /* Minimum number of seconds between records. */
+  double interval;
+  double last_commit;
+};
+
+/* Sequence numbers of items already completed by a previous run. */
+struct completed_items {
+  uint8_t *bits;
+  int64_t num_bits;
+  int64_t count;
+};
+
+/* Open (or, when resuming, append to) the checkpoint log for a thread
+   writing to num_outputs output files. */
+void init_checkpoint(struct checkpoint_writer *writer, const char *file_name,
+                     double interval, int resume,
+                     FILE **outputs, int num_outputs);
+/* Record that item seq has been fully written to the outputs,
+   committing a checkpoint if the interval has elapsed. */
+void checkpoint_item_done(struct checkpoint_writer *writer, int64_t seq);
+/* Flush and fsync the outputs and write a record for pending items. */
+void checkpoint_commit(struct checkpoint_writer *writer);
+void close_checkpoint(struct checkpoint_writer *writer);
+
+/* Read a checkpoint log, adding its items to completed. The log is
+   truncated after its last intact record, and each of the output_files
+   is truncated to its size in that record (or to zero if the log has
+   no intact records). Returns 0 if the log does not exist. */
+int load_checkpoint(const char *file_name, const char **output_files,
+                    int num_outputs, struct completed_items *completed);
+int item_completed(const struct completed_items *completed, int64_t seq);
+void free_completed_items(struct completed_items *completed);
+
+#endif
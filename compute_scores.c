@@ -1,6 +1,11 @@
 #include "stdlib.h"
+#include "assert.h"
+#include "string.h"
+#include "stdint.h"
+#include "math.h"
 
 #include "compute_scores.h"
+#include "arena.h"
 
 void set_node(struct dense_graph graph, int node_number,
               double controversy, double edits, int real_id) {
@@ -27,6 +32,20 @@ struct dense_graph make_graph(int num_nodes) {
   return ret;
 }
 
+struct dense_graph make_arena_graph(struct arena *arena, int num_nodes,
+                                    int with_edges) {
+  struct dense_graph ret;
+  ret.num_nodes = num_nodes;
+  ret.edges = NULL;
+  if (with_edges) {
+    ret.edges = arena_calloc(
+        arena, (size_t)num_nodes * (size_t)num_nodes * sizeof(double));
+  }
+  ret.nodes = arena_calloc(arena,
+                           (size_t)num_nodes * sizeof(struct node_info));
+  return ret;
+}
+
 void free_graph(struct dense_graph graph) {
   free(graph.edges);
   free(graph.nodes);
@@ -34,8 +53,7 @@ void free_graph(struct dense_graph graph) {
   graph.nodes = NULL;
 }
 
-double coeff(struct dense_graph graph, FILE* coeff_out,
-             double* avg_cont, double* avg_clust) {
+void accumulate_coeff(struct dense_graph graph) {
   for (int i = 0; i < graph.num_nodes; ++i) {
     graph.nodes[i].numerator = 0.0;
     graph.nodes[i].denominator = 0.0;
@@ -65,6 +83,174 @@ double coeff(struct dense_graph graph, FILE* coeff_out,
       }
     }
   }
+}
+
+/* accumulate_coeff_row() over packed edges of type TYPE, each read
+   as a double by DECODE. */
+#define DEFINE_ACCUMULATE_ROW(NAME, TYPE, DECODE)                       \
+  static inline void NAME(struct dense_graph graph, const TYPE *packed,  \
+                          int i) {                                      \
+    int n = graph.num_nodes;                                            \
+    struct node_info *restrict nodes = graph.nodes;                     \
+    const TYPE *row_i = packed + packed_row_offset(n, i);               \
+    for (int j = i + 1; j < n; ++j) {                                   \
+      double ij_edge = DECODE(row_i[j - i - 1]);                        \
+      /* The (i, k) and (j, k) edges for k > j, both starting at       \
+         k = j + 1. */                                                  \
+      const TYPE *restrict ik_edges = row_i + (j - i);                  \
+      const TYPE *restrict jk_edges = packed + packed_row_offset(n, j); \
+      for (int k = j + 1; k < n; ++k) {                                 \
+        double ik_edge = DECODE(ik_edges[k - j - 1]);                   \
+        double jk_edge = DECODE(jk_edges[k - j - 1]);                   \
+        double numerator_addition = ij_edge * jk_edge * ik_edge;        \
+                                                                        \
+        double editfraction = nodes[j].edits * nodes[k].edits           \
+            * nodes[j].controversy * nodes[k].controversy;              \
+        nodes[i].numerator += numerator_addition * editfraction;        \
+        nodes[i].denominator += ij_edge * ik_edge * editfraction;       \
+                                                                        \
+        editfraction = nodes[i].edits * nodes[k].edits                  \
+            * nodes[i].controversy * nodes[k].controversy;              \
+        nodes[j].numerator += numerator_addition * editfraction;        \
+        nodes[j].denominator += ij_edge * jk_edge * editfraction;       \
+                                                                        \
+        editfraction = nodes[i].edits * nodes[j].edits                  \
+            * nodes[i].controversy * nodes[j].controversy;              \
+        nodes[k].numerator += numerator_addition * editfraction;        \
+        nodes[k].denominator += jk_edge * ik_edge * editfraction;       \
+      }                                                                 \
+    }                                                                   \
+  }
+
+#define DECODE_DOUBLE(x) (x)
+#define DECODE_FLOAT(x) ((double)(x))
+#define DECODE_UINT16(x) ((x) * (1.0 / UINT16_MAX))
+
+DEFINE_ACCUMULATE_ROW(accumulate_row_double, double, DECODE_DOUBLE)
+DEFINE_ACCUMULATE_ROW(accumulate_row_float, float, DECODE_FLOAT)
+DEFINE_ACCUMULATE_ROW(accumulate_row_uint16, uint16_t, DECODE_UINT16)
+
+void accumulate_coeff_row(struct dense_graph graph, const double *packed,
+                          int i) {
+  accumulate_row_double(graph, packed, i);
+}
+
+static const char *precision_names[NUM_PRECISIONS] = {
+  "double", "float", "uint16"
+};
+
+const char *precision_name(enum edge_precision precision) {
+  assert(precision >= 0 && precision < NUM_PRECISIONS);
+  return precision_names[precision];
+}
+
+int parse_precision(const char *name, enum edge_precision *precision) {
+  for (int i = 0; i < NUM_PRECISIONS; ++i) {
+    if (strcmp(name, precision_names[i]) == 0) {
+      *precision = (enum edge_precision)i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+size_t edge_bytes(enum edge_precision precision) {
+  switch (precision) {
+    case PRECISION_FLOAT:
+      return sizeof(float);
+    case PRECISION_UINT16:
+      return sizeof(uint16_t);
+    default:
+      return sizeof(double);
+  }
+}
+
+void pack_edges(enum edge_precision precision, const double *row,
+                size_t count, void *packed) {
+  if (precision == PRECISION_FLOAT) {
+    float *out = packed;
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = (float)row[i];
+    }
+  } else if (precision == PRECISION_UINT16) {
+    uint16_t *out = packed;
+    for (size_t i = 0; i < count; ++i) {
+      double value = row[i] < 0.0 ? 0.0 : (row[i] > 1.0 ? 1.0 : row[i]);
+      out[i] = (uint16_t)lrint(value * UINT16_MAX);
+    }
+  } else {
+    memcpy(packed, row, count * sizeof(double));
+  }
+}
+
+void accumulate_coeff_row_precision(struct dense_graph graph,
+                                    const void *packed, int i,
+                                    enum edge_precision precision) {
+  switch (precision) {
+    case PRECISION_FLOAT:
+      accumulate_row_float(graph, packed, i);
+      break;
+    case PRECISION_UINT16:
+      accumulate_row_uint16(graph, packed, i);
+      break;
+    default:
+      accumulate_row_double(graph, packed, i);
+      break;
+  }
+}
+
+void accumulate_coeff_pair(struct dense_graph first,
+                           struct dense_graph second) {
+  assert(first.num_nodes == second.num_nodes);
+  int n = first.num_nodes;
+  for (int i = 0; i < n; ++i) {
+    first.nodes[i].numerator = 0.0;
+    first.nodes[i].denominator = 0.0;
+    second.nodes[i].numerator = 0.0;
+    second.nodes[i].denominator = 0.0;
+  }
+  // Node weights are the same in both graphs, so they are read once
+  // from the first.
+  const struct node_info *nodes = first.nodes;
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j) {
+      double first_ij = first.edges[n * i + j];
+      double second_ij = second.edges[n * i + j];
+      for (int k = j + 1; k < n; ++k) {
+        double first_ik = first.edges[n * i + k];
+        double first_jk = first.edges[n * j + k];
+        double second_ik = second.edges[n * i + k];
+        double second_jk = second.edges[n * j + k];
+        double first_triangle = first_ij * first_jk * first_ik;
+        double second_triangle = second_ij * second_jk * second_ik;
+
+        double editfraction = nodes[j].edits * nodes[k].edits
+            * nodes[j].controversy * nodes[k].controversy;
+        first.nodes[i].numerator += first_triangle * editfraction;
+        first.nodes[i].denominator += first_ij * first_ik * editfraction;
+        second.nodes[i].numerator += second_triangle * editfraction;
+        second.nodes[i].denominator += second_ij * second_ik * editfraction;
+
+        editfraction = nodes[i].edits * nodes[k].edits
+            * nodes[i].controversy * nodes[k].controversy;
+        first.nodes[j].numerator += first_triangle * editfraction;
+        first.nodes[j].denominator += first_ij * first_jk * editfraction;
+        second.nodes[j].numerator += second_triangle * editfraction;
+        second.nodes[j].denominator += second_ij * second_jk * editfraction;
+
+        editfraction = nodes[i].edits * nodes[j].edits
+            * nodes[i].controversy * nodes[j].controversy;
+        first.nodes[k].numerator += first_triangle * editfraction;
+        first.nodes[k].denominator += first_jk * first_ik * editfraction;
+        second.nodes[k].numerator += second_triangle * editfraction;
+        second.nodes[k].denominator += second_jk * second_ik * editfraction;
+      }
+    }
+  }
+}
+
+double finish_coeff(struct dense_graph graph, FILE* coeff_out,
+                    double* avg_cont, double* avg_clust) {
   double average_coeff = 0.0;
   double average_cont = 0.0;
   double average_clust = 0.0;
@@ -104,3 +290,9 @@ double coeff(struct dense_graph graph, FILE* coeff_out,
   }
   return average_coeff;
 }
+
+double coeff(struct dense_graph graph, FILE* coeff_out,
+             double* avg_cont, double* avg_clust) {
+  accumulate_coeff(graph);
+  return finish_coeff(graph, coeff_out, avg_cont, avg_clust);
+}
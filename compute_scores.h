@@ -2,8 +2,13 @@
    similarities), compute its CC, controversy, and clustering
    scores. */
 
+#ifndef __compute_scores_h__
+#define __compute_scores_h__
+
 #include "stdio.h"
 
+struct arena;
+
 struct node_info {
   double controversy;
   double edits;
@@ -25,9 +30,69 @@ void set_edge(struct dense_graph graph,
               double weight);
 struct dense_graph make_graph(int num_nodes);
 void free_graph(struct dense_graph graph);
+/* make_graph() from arena memory, which is not freed with
+   free_graph(). Without edges, only the nodes are allocated, for use
+   with accumulate_coeff_row(). */
+struct dense_graph make_arena_graph(struct arena *arena, int num_nodes,
+                                    int with_edges);
 
 /* Compute the CC, average controversy, and average clustering scores
    for the graph. Returns the CC score, and writes the page-level scores
    (controversy and clustering) to coeff_out. */
 double coeff(struct dense_graph graph, FILE* coeff_out,
              double* avg_cont, double* avg_clust);
+
+/* The two halves of coeff(): accumulate the per-node clustering
+   numerators and denominators over all triangles, then combine them
+   into the scores. */
+void accumulate_coeff(struct dense_graph graph);
+double finish_coeff(struct dense_graph graph, FILE* coeff_out,
+                    double* avg_cont, double* avg_clust);
+/* Packed upper triangular edge storage: the edges (i, j) for j > i
+   are contiguous, starting at packed_row_offset(n, i) + 0 for
+   j = i + 1. */
+static inline size_t packed_row_offset(int n, int i) {
+  return (size_t)i * (2 * (size_t)n - i - 1) / 2;
+}
+static inline size_t packed_size(int n) {
+  return (size_t)n * (n - 1) / 2;
+}
+/* Add the contributions of every triangle whose lowest node is i to
+   the graph's node accumulators, which start at zero. Needs packed rows
+   i through n - 1, so rows can be computed from the last one up and
+   each folded in while it is still in cache. The triangles are visited
+   in a different order than accumulate_coeff(), so results may differ
+   in the last bits. */
+void accumulate_coeff_row(struct dense_graph graph, const double *packed,
+                          int i);
+
+/* Storage types for packed edges. Similarities lie in [0, 1], so
+   uint16 stores them in steps of 1/65535. Triangles are accumulated in
+   double whatever the storage. */
+enum edge_precision {
+  PRECISION_DOUBLE,
+  PRECISION_FLOAT,
+  PRECISION_UINT16,
+  NUM_PRECISIONS
+};
+
+/* Returns 0 if name is not double, float, or uint16. */
+int parse_precision(const char *name, enum edge_precision *precision);
+const char *precision_name(enum edge_precision precision);
+size_t edge_bytes(enum edge_precision precision);
+/* Store count edges from row into packed, an array of the precision's
+   type. */
+void pack_edges(enum edge_precision precision, const double *row,
+                size_t count, void *packed);
+/* accumulate_coeff_row() for packed edges stored at precision, where
+   packed points to the start of the triangle. */
+void accumulate_coeff_row_precision(struct dense_graph graph,
+                                    const void *packed, int i,
+                                    enum edge_precision precision);
+
+/* accumulate_coeff() for two graphs over the same nodes with
+   different edges, in a single pass over the triangles. */
+void accumulate_coeff_pair(struct dense_graph first,
+                           struct dense_graph second);
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "dedup.h"
+#include "read_mmap.h"
+#include "metrics.h"
+
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= UINT64_C(0xbf58476d1ce4e5b9);
+  x ^= x >> 27;
+  x *= UINT64_C(0x94d049bb133111eb);
+  x ^= x >> 31;
+  return x;
+}
+
+static inline double edit_fraction(const struct mmap_item *user,
+                                   const struct mmap_feature *page) {
+  return div_ignore_zero(page->feature_value, user->sum_or_norm);
+}
+
+void init_deduper(struct deduper *d, int window, const char *mmap_users,
+                  const struct mmap_item *users, int64_t num_users) {
+  d->mmap_users = mmap_users;
+  d->users = users;
+  d->num_users = num_users;
+  d->window = window;
+  d->pending = malloc(window * sizeof(struct user_group*));
+  d->num_pending = 0;
+  int64_t table_size = 1;
+  while (table_size < 2 * (int64_t)window) {
+    table_size *= 2;
+  }
+  d->table = calloc(table_size, sizeof(struct dedup_slot));
+  d->table_mask = table_size - 1;
+  d->num_duplicates = 0;
+}
+
+void free_deduper(struct deduper *d) {
+  assert(d->num_pending == 0);
+  free(d->pending);
+  free(d->table);
+  d->pending = NULL;
+  d->table = NULL;
+}
+
+static const struct mmap_item *dedup_user(const struct deduper *d,
+                                          const struct user_group *work) {
+  if (work->num_users != 1 || work->pages != NULL
+      || work->userids[0] >= d->num_users) {
+    return NULL;
+  }
+  const struct mmap_item *user = d->users + work->userids[0];
+  if (get_features(d->mmap_users, user) == NULL
+      || user->count_features == 0
+      || user->count_features > MAX_USER_PAGES) {
+    return NULL;
+  }
+  return user;
+}
+
+static uint64_t hash_vector(const struct deduper *d,
+                            const struct mmap_item *user) {
+  const struct mmap_feature *pages = get_features(d->mmap_users, user);
+  uint64_t hash = mix64((uint64_t)user->count_features);
+  for (int64_t i = 0; i < user->count_features; ++i) {
+    double fraction = edit_fraction(user, pages + i);
+    uint64_t bits;
+    memcpy(&bits, &fraction, sizeof(bits));
+    hash = mix64(hash ^ (uint64_t)pages[i].feature_number);
+    hash = mix64(hash ^ bits);
+  }
+  return hash;
+}
+
+static int same_vector(const struct deduper *d, const struct mmap_item *first,
+                       const struct mmap_item *second) {
+  if (first->count_features != second->count_features) {
+    return 0;
+  }
+  const struct mmap_feature *first_pages = get_features(d->mmap_users, first);
+  const struct mmap_feature *second_pages = get_features(d->mmap_users,
+                                                         second);
+  for (int64_t i = 0; i < first->count_features; ++i) {
+    if (first_pages[i].feature_number != second_pages[i].feature_number
+        || edit_fraction(first, first_pages + i)
+        != edit_fraction(second, second_pages + i)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void deduper_add(struct deduper *d, struct user_group *work,
+                 emit_work_fn emit, void *context) {
+  work->duplicates = NULL;
+  const struct mmap_item *user = dedup_user(d, work);
+  if (user == NULL) {
+    emit(work, context);
+    return;
+  }
+  uint64_t hash = hash_vector(d, user);
+  int64_t slot = (int64_t)(hash & (uint64_t)d->table_mask);
+  for (; d->table[slot].item != NULL;
+       slot = (slot + 1) & d->table_mask) {
+    struct dedup_slot *entry = d->table + slot;
+    if (entry->hash == hash
+        && same_vector(d, d->users + entry->item->userids[0], user)) {
+      entry->last_duplicate->duplicates = work;
+      entry->last_duplicate = work;
+      ++d->num_duplicates;
+      return;
+    }
+  }
+  d->table[slot].hash = hash;
+  d->table[slot].item = work;
+  d->table[slot].last_duplicate = work;
+  d->pending[d->num_pending++] = work;
+  if (d->num_pending == d->window) {
+    deduper_flush(d, emit, context);
+  }
+}
+
+void deduper_flush(struct deduper *d, emit_work_fn emit, void *context) {
+  for (int i = 0; i < d->num_pending; ++i) {
+    emit(d->pending[i], context);
+  }
+  if (d->num_pending > 0) {
+    memset(d->table, 0, (d->table_mask + 1) * sizeof(struct dedup_slot));
+  }
+  d->num_pending = 0;
+}
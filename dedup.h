@@ -0,0 +1,54 @@
+/* Deduplication of users with identical normalized page vectors. A
+   user's scores depend only on its pages and their edit fractions, so
+   users who edited the same pages in the same proportions (bots and
+   single-topic editors, often) score identically. The reader holds a
+   window of single-user items, hashing each item's (pageid, edit
+   fraction) vector from users_mmap. An item whose vector matches a
+   pending one is attached to it as a duplicate instead of being
+   scored. The worker scores each distinct vector once and writes its
+   lines under every duplicate's userid too. Edit fractions are
+   compared exactly; proportional edit counts give equal fractions, as
+   division is correctly rounded. */
+
+#ifndef __dedup_h__
+#define __dedup_h__
+
+#include <stdint.h>
+
+#include "score_thread.h"
+
+struct dedup_slot {
+  uint64_t hash;
+  /* Pending representative, or NULL if the slot is empty. */
+  struct user_group *item;
+  /* The last of its duplicates, to append to in input order. */
+  struct user_group *last_duplicate;
+};
+
+struct deduper {
+  const char *mmap_users;
+  const struct mmap_item *users;
+  int64_t num_users;
+  int window;
+  /* Representatives in input order. */
+  struct user_group **pending;
+  int num_pending;
+  /* Open addressing table of the pending representatives, with twice
+     as many slots as the window, rounded up to a power of two. */
+  struct dedup_slot *table;
+  int64_t table_mask;
+  int64_t num_duplicates;
+};
+
+void init_deduper(struct deduper *d, int window, const char *mmap_users,
+                  const struct mmap_item *users, int64_t num_users);
+/* Add a work item. Items that cannot be deduplicated are emitted
+   immediately; the others are emitted, with their duplicates attached,
+   once the window fills. */
+void deduper_add(struct deduper *d, struct user_group *work,
+                 emit_work_fn emit, void *context);
+/* Emit everything still pending. */
+void deduper_flush(struct deduper *d, emit_work_fn emit, void *context);
+void free_deduper(struct deduper *d);
+
+#endif
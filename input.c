@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "input.h"
+#include "read_mmap.h"
+#include "score_thread.h"
+
+#define INPUT_BUFFER_SIZE (1 << 20)
+#define INITIAL_IDS 64
+
+static struct user_group *make_group(struct input_reader *reader,
+                                     const int64_t *ids, int num_ids) {
+  struct user_group *work = malloc(sizeof(struct user_group));
+  work->num_users = num_ids;
+  work->userids = malloc(sizeof(int64_t) * num_ids);
+  memcpy(work->userids, ids, sizeof(int64_t) * num_ids);
+  work->sequence = reader->sequence++;
+  work->next = NULL;
+  work->duplicates = NULL;
+  work->pages = NULL;
+  work->num_pages = 0;
+  work->event_time = 0.0;
+  work->cc_bound = 0.0;
+  return work;
+}
+
+void open_text_input(struct input_reader *reader, const char *file_name) {
+  memset(reader, 0, sizeof(struct input_reader));
+  reader->kind = INPUT_TEXT;
+  reader->fp = fopen(file_name, "r");
+  if (reader->fp == NULL) {
+    fprintf(stderr, "Could not open %s\n", file_name);
+    exit(1);
+  }
+  reader->buffer = malloc(INPUT_BUFFER_SIZE);
+  reader->max_ids = INITIAL_IDS;
+  reader->ids = malloc(reader->max_ids * sizeof(int64_t));
+}
+
+void open_binary_input(struct input_reader *reader, const char *file_name) {
+  memset(reader, 0, sizeof(struct input_reader));
+  reader->kind = INPUT_BINARY;
+  reader->binary_fd = open(file_name, O_RDONLY);
+  if (reader->binary_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", file_name);
+    exit(1);
+  }
+  int64_t size = get_mmap_size(reader->binary_fd);
+  if (size % sizeof(int64_t) != 0) {
+    fprintf(stderr, "%s is not a binary userid file\n", file_name);
+    exit(1);
+  }
+  reader->binary_length = size / sizeof(int64_t);
+  // make_mmap writes an empty file for an empty list, which cannot be
+  // mapped.
+  if (size == 0) {
+    reader->binary = NULL;
+    return;
+  }
+  reader->binary = mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+                        reader->binary_fd, 0);
+  if (reader->binary == MAP_FAILED) {
+    fprintf(stderr, "Could not memory map file %s\n", file_name);
+    exit(1);
+  }
+}
+
+void open_all_users_input(struct input_reader *reader,
+                          const struct mmap_item *users,
+                          int64_t first_userid, int64_t end_userid) {
+  memset(reader, 0, sizeof(struct input_reader));
+  reader->kind = INPUT_ALL_USERS;
+  reader->users = users;
+  reader->next_userid = first_userid;
+  reader->end_userid = end_userid;
+}
+
+void open_page_users_input(struct input_reader *reader,
+                           const char *pages_file,
+                           const char *page_users_mmap_file,
+                           int64_t num_users) {
+  struct input_reader page_input;
+  open_text_input(&page_input, pages_file);
+  int page_users_fd;
+  const char *page_users_mmap = open_mmap_read(page_users_mmap_file,
+                                               &page_users_fd);
+  int64_t num_pages;
+  const struct mmap_item *pages = get_items(page_users_mmap, &num_pages);
+  memset(reader, 0, sizeof(struct input_reader));
+  reader->kind = INPUT_PAGE_USERS;
+  reader->end_userid = num_users;
+  reader->selected_users = calloc(num_users > 0 ? num_users : 1, 1);
+  struct user_group *page_group;
+  while ((page_group = next_input_group(&page_input)) != NULL) {
+    for (int i = 0; i < page_group->num_users; ++i) {
+      int64_t pageid = page_group->userids[i];
+      ++reader->num_query_pages;
+      if (pageid >= num_pages) {
+        continue;
+      }
+      const struct mmap_feature *page_users = get_features(
+          page_users_mmap, pages + pageid);
+      for (int64_t j = 0;
+           page_users != NULL && j < pages[pageid].count_features; ++j) {
+        int64_t userid = page_users[j].feature_number;
+        assert(userid < num_users);
+        if (!reader->selected_users[userid]) {
+          reader->selected_users[userid] = 1;
+          ++reader->num_selected_users;
+        }
+      }
+    }
+    free(page_group->userids);
+    free(page_group);
+  }
+  reader->num_malformed_lines = page_input.num_malformed_lines;
+  close_input(&page_input);
+  munmap((void*)page_users_mmap, get_mmap_size(page_users_fd));
+  close(page_users_fd);
+}
+
+static void append_id(struct input_reader *reader, int *num_ids,
+                      int64_t id) {
+  if (*num_ids == reader->max_ids) {
+    reader->max_ids *= 2;
+    reader->ids = realloc(reader->ids, reader->max_ids * sizeof(int64_t));
+  }
+  reader->ids[(*num_ids)++] = id;
+}
+
+static struct user_group *next_text_group(struct input_reader *reader) {
+  int num_ids = 0;
+  int in_number = 0;
+  int malformed = 0;
+  int64_t value = 0;
+  while (1) {
+    int end_of_input = 0;
+    if (reader->buffer_pos == reader->buffer_fill) {
+      reader->buffer_fill = fread(reader->buffer, 1, INPUT_BUFFER_SIZE,
+                                  reader->fp);
+      reader->buffer_pos = 0;
+      end_of_input = reader->buffer_fill == 0;
+    }
+    char c = end_of_input ? '\n' : reader->buffer[reader->buffer_pos++];
+    if (malformed) {
+      // Skip to the end of the line.
+    } else if (c >= '0' && c <= '9') {
+      if (value > (INT64_MAX - (c - '0')) / 10) {
+        malformed = 1;
+      } else {
+        value = value * 10 + (c - '0');
+        in_number = 1;
+      }
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      if (in_number) {
+        append_id(reader, &num_ids, value);
+        value = 0;
+        in_number = 0;
+      }
+    } else {
+      malformed = 1;
+    }
+    if (c == '\n') {
+      if (malformed) {
+        ++reader->num_malformed_lines;
+      } else if (num_ids > 0) {
+        return make_group(reader, reader->ids, num_ids);
+      }
+      if (end_of_input) {
+        return NULL;
+      }
+      num_ids = 0;
+      in_number = 0;
+      malformed = 0;
+      value = 0;
+    }
+  }
+}
+
+static struct user_group *next_binary_group(struct input_reader *reader) {
+  if (reader->binary_pos == reader->binary_length) {
+    return NULL;
+  }
+  int64_t count = reader->binary[reader->binary_pos];
+  if (count < 1 || count > INT32_MAX
+      || reader->binary_pos + 1 + count > reader->binary_length) {
+    fprintf(stderr, "Corrupt binary userid list at offset %" PRId64 "\n",
+            reader->binary_pos * (int64_t)sizeof(int64_t));
+    exit(1);
+  }
+  const int64_t *ids = reader->binary + reader->binary_pos + 1;
+  reader->binary_pos += 1 + count;
+  return make_group(reader, ids, (int)count);
+}
+
+static int skip_user(const struct input_reader *reader, int64_t userid) {
+  if (reader->kind == INPUT_PAGE_USERS) {
+    return !reader->selected_users[userid];
+  }
+  return reader->users[userid].features_offset == 0;
+}
+
+static struct user_group *next_all_users_group(struct input_reader *reader) {
+  while (reader->next_userid < reader->end_userid
+         && skip_user(reader, reader->next_userid)) {
+    ++reader->next_userid;
+  }
+  if (reader->next_userid >= reader->end_userid) {
+    return NULL;
+  }
+  // Sequence numbers are userids, so they do not depend on which users
+  // have pages.
+  reader->sequence = reader->next_userid;
+  int64_t userid = reader->next_userid++;
+  return make_group(reader, &userid, 1);
+}
+
+struct user_group *next_input_group(struct input_reader *reader) {
+  switch (reader->kind) {
+    case INPUT_TEXT:
+      return next_text_group(reader);
+    case INPUT_BINARY:
+      return next_binary_group(reader);
+    case INPUT_ALL_USERS:
+    case INPUT_PAGE_USERS:
+      return next_all_users_group(reader);
+  }
+  assert(0);
+  return NULL;
+}
+
+void close_input(struct input_reader *reader) {
+  if (reader->kind == INPUT_TEXT) {
+    fclose(reader->fp);
+    free(reader->buffer);
+    free(reader->ids);
+  } else if (reader->kind == INPUT_BINARY) {
+    if (reader->binary != NULL) {
+      munmap((void*)reader->binary,
+             reader->binary_length * sizeof(int64_t));
+    }
+    close(reader->binary_fd);
+  } else if (reader->kind == INPUT_PAGE_USERS) {
+    free(reader->selected_users);
+  }
+}
@@ -0,0 +1,78 @@
+/* Sources of work items for cc_mmap. Work items are read from:
+   - a text file with one user or space-separated group of users per
+     line, parsed in a single streaming pass with no line length limit.
+     Lines with anything but digits and whitespace are skipped and
+     counted;
+   - a binary file of count-prefixed lists: an int64_t count followed by
+     count int64_t userids, repeated (written by make_mmap);
+   - users_mmap itself, yielding every user that has pages;
+   - a text file of pageids, yielding every user who edited one of the
+     pages, found through the page_users_mmap reverse index. */
+
+#ifndef __input_h__
+#define __input_h__
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct user_group;
+struct mmap_item;
+
+enum input_kind {
+  INPUT_TEXT,
+  INPUT_BINARY,
+  INPUT_ALL_USERS,
+  INPUT_PAGE_USERS
+};
+
+struct input_reader {
+  enum input_kind kind;
+  /* Position of the next item in the input. */
+  int64_t sequence;
+  /* INPUT_TEXT */
+  FILE *fp;
+  char *buffer;
+  size_t buffer_fill;
+  size_t buffer_pos;
+  int64_t *ids;
+  int max_ids;
+  /* Lines skipped for holding anything other than ids separated by
+     whitespace, or an id too large for an int64_t. */
+  int64_t num_malformed_lines;
+  /* INPUT_BINARY */
+  const int64_t *binary;
+  int64_t binary_length;
+  int64_t binary_pos;
+  int binary_fd;
+  /* INPUT_ALL_USERS and INPUT_PAGE_USERS */
+  const struct mmap_item *users;
+  int64_t end_userid;
+  int64_t next_userid;
+  /* INPUT_PAGE_USERS: which users edited a queried page. */
+  uint8_t *selected_users;
+  int64_t num_query_pages;
+  int64_t num_selected_users;
+};
+
+void open_text_input(struct input_reader *reader, const char *file_name);
+void open_binary_input(struct input_reader *reader, const char *file_name);
+/* Iterate users with pages whose ids are in [first_userid,
+   end_userid). */
+void open_all_users_input(struct input_reader *reader,
+                          const struct mmap_item *users,
+                          int64_t first_userid, int64_t end_userid);
+/* Iterate, in userid order and without duplicates, the users who edited
+   any of the pageids listed (whitespace separated) in
+   pages_file. page_users_mmap_file is the reverse index written by
+   make_mmap --page-users. */
+void open_page_users_input(struct input_reader *reader,
+                           const char *pages_file,
+                           const char *page_users_mmap_file,
+                           int64_t num_users);
+
+/* Allocate and return the next work item, with its sequence set, or
+   NULL at the end of the input. */
+struct user_group *next_input_group(struct input_reader *reader);
+void close_input(struct input_reader *reader);
+
+#endif
@@ -5,6 +5,7 @@
 #include <math.h>
 #include <inttypes.h>
 
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -13,6 +14,8 @@
 
 #include "read_mmap.h"
 #include "score_thread.h"
+#include "input.h"
+#include "block_store.h"
 
 #define MAX_PAGE_DID 5000000
 #define MAX_NUM_FEATURES 2000000
@@ -70,7 +73,8 @@ int get_next_item(struct tuple_file_iterator *workspace,
   if (workspace->read_from == NULL) {
     return 0;
   }
-  int64_t new_left_id;
+  // fscanf leaves this untouched at EOF
+  int64_t new_left_id = workspace->current_left_id;
   int64_t middle_value;
   double right_value;
   int fscanf_return = 1;
@@ -292,10 +296,232 @@ void transcribe_controversy(const char *in_file, const char *out_file) {
   printf("Wrote %s\n", out_file);
 }
 
+/* Convert a text list of users and groups (as read by cc_mmap) to
+   count-prefixed int64_t lists, which cc_mmap can read without
+   parsing. */
+void transcribe_userids(const char *in_file, const char *out_file) {
+  struct input_reader input;
+  open_text_input(&input, in_file);
+  FILE *out_fid = fopen(out_file, "wb");
+  if (out_fid == NULL) {
+    fprintf(stderr, "Could not create %s\n", out_file);
+    exit(1);
+  }
+  int64_t num_groups = 0;
+  struct user_group *group;
+  while ((group = next_input_group(&input)) != NULL) {
+    int64_t count = group->num_users;
+    fwrite(&count, sizeof(int64_t), 1, out_fid);
+    fwrite(group->userids, sizeof(int64_t), count, out_fid);
+    free(group->userids);
+    free(group);
+    ++num_groups;
+  }
+  if (input.num_malformed_lines > 0) {
+    printf("Skipped %" PRId64 " malformed lines in %s\n",
+           input.num_malformed_lines, in_file);
+  }
+  close_input(&input);
+  fclose(out_fid);
+  printf("Wrote %s: %" PRId64 " groups\n", out_file, num_groups);
+}
+
+/* One thread's share of the users_mmap transpose: the pages in
+   [first_page, end_page). */
+struct transpose_range {
+  const char *user_mmap;
+  const struct mmap_item *users;
+  int64_t num_users;
+  char *page_mmap;
+  struct mmap_item *pages;
+  int64_t first_page;
+  int64_t end_page;
+  /* Next feature to write for each page in the range. */
+  int64_t *cursors;
+  /* 0 to count each page's users, 1 to write them. */
+  int fill;
+};
+
+/* Index of the first feature of item whose number is at least
+   feature_number. Features are sorted by number. */
+int64_t lower_bound_feature(const struct mmap_feature *features,
+                            int64_t count, int64_t feature_number) {
+  int64_t low = 0;
+  int64_t high = count;
+  while (low < high) {
+    int64_t middle = low + (high - low) / 2;
+    if (features[middle].feature_number < feature_number) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/* Scan every user, counting or writing the entries that fall in the
+   thread's page range. Each thread owns its pages outright, so no
+   locking is needed, and users are visited in order so each page's
+   users come out sorted. */
+void* transpose_users(void *range_info) {
+  struct transpose_range *range = range_info;
+  for (int64_t userid = 0; userid < range->num_users; ++userid) {
+    const struct mmap_item *user = range->users + userid;
+    const struct mmap_feature *user_pages = get_features(range->user_mmap,
+                                                         user);
+    if (user_pages == NULL) {
+      continue;
+    }
+    for (int64_t i = lower_bound_feature(user_pages, user->count_features,
+                                         range->first_page);
+         i < user->count_features
+             && user_pages[i].feature_number < range->end_page;
+         ++i) {
+      struct mmap_item *page = range->pages + user_pages[i].feature_number;
+      if (range->fill) {
+        int64_t *cursor = range->cursors
+            + (user_pages[i].feature_number - range->first_page);
+        struct mmap_feature *page_users = (struct mmap_feature*)(
+            range->page_mmap + *cursor);
+        page_users->feature_number = userid;
+        page_users->feature_value = user_pages[i].feature_value;
+        page->sum_or_norm += user_pages[i].feature_value;
+        *cursor += sizeof(struct mmap_feature);
+      } else {
+        ++page->count_features;
+      }
+    }
+  }
+  return NULL;
+}
+
+void run_transpose(struct transpose_range *ranges, int num_threads) {
+  pthread_t *pths = malloc(num_threads * sizeof(pthread_t));
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_create(pths + i, NULL, transpose_users, ranges + i);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(pths[i], NULL);
+  }
+  free(pths);
+}
+
+/* Write the page -> users reverse index of users_mmap: one item per
+   page, whose features are (userid, edit count) pairs sorted by userid
+   and whose sum_or_norm is the page's total edit count. Page counts
+   are taken in a first parallel pass, which sizes the file; a second
+   pass fills it in. */
+void transcribe_page_users(const char *users_mmap_file, const char *out_file,
+                           int num_threads) {
+  int user_mmapfd;
+  const char *user_mmap = open_mmap_read(users_mmap_file, &user_mmapfd);
+  int64_t num_users;
+  const struct mmap_item *users = get_items(user_mmap, &num_users);
+  int64_t num_pages = 0;
+  int64_t num_entries = 0;
+  for (int64_t userid = 0; userid < num_users; ++userid) {
+    const struct mmap_feature *user_pages = get_features(user_mmap,
+                                                         users + userid);
+    if (user_pages != NULL && users[userid].count_features > 0) {
+      int64_t last_page = user_pages[
+          users[userid].count_features - 1].feature_number;
+      if (last_page + 1 > num_pages) {
+        num_pages = last_page + 1;
+      }
+      num_entries += users[userid].count_features;
+    }
+  }
+  int64_t items_offset = sizeof(struct mmap_header);
+  int64_t features_offset = items_offset
+      + num_pages * sizeof(struct mmap_item);
+  int64_t mmap_size = features_offset
+      + num_entries * sizeof(struct mmap_feature);
+  printf("Writing %s: %" PRId64 " bytes\n", out_file, mmap_size);
+  int outfd;
+  char *mmap = create_mmap(out_file, mmap_size, &outfd);
+  set_mmap_header(mmap, items_offset, num_pages);
+  struct mmap_item *pages = (struct mmap_item*)(mmap + items_offset);
+
+  if (num_threads > num_pages) {
+    num_threads = num_pages > 0 ? (int)num_pages : 1;
+  }
+  struct transpose_range *ranges = malloc(
+      num_threads * sizeof(struct transpose_range));
+  for (int i = 0; i < num_threads; ++i) {
+    ranges[i].user_mmap = user_mmap;
+    ranges[i].users = users;
+    ranges[i].num_users = num_users;
+    ranges[i].page_mmap = mmap;
+    ranges[i].pages = pages;
+    ranges[i].first_page = num_pages * i / num_threads;
+    ranges[i].end_page = num_pages * (i + 1) / num_threads;
+    ranges[i].cursors = NULL;
+    ranges[i].fill = 0;
+  }
+  run_transpose(ranges, num_threads);
+
+  // Lay out each page's users, in page order.
+  int64_t next_offset = features_offset;
+  for (int i = 0; i < num_threads; ++i) {
+    int64_t range_pages = ranges[i].end_page - ranges[i].first_page;
+    ranges[i].cursors = malloc(range_pages * sizeof(int64_t));
+    for (int64_t j = 0; j < range_pages; ++j) {
+      struct mmap_item *page = pages + ranges[i].first_page + j;
+      page->id = ranges[i].first_page + j;
+      if (page->count_features > 0) {
+        page->features_offset = next_offset;
+        next_offset += page->count_features * sizeof(struct mmap_feature);
+      }
+      ranges[i].cursors[j] = page->features_offset;
+    }
+    ranges[i].fill = 1;
+  }
+  assert(next_offset == mmap_size);
+  run_transpose(ranges, num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    free(ranges[i].cursors);
+  }
+  free(ranges);
+  munmap(mmap, mmap_size);
+  close(outfd);
+  munmap((void*)user_mmap, get_mmap_size(user_mmapfd));
+  close(user_mmapfd);
+  printf("%s written: %" PRId64 " pages, %" PRId64 " entries\n", out_file,
+         num_pages, num_entries);
+}
+
+void print_usage(const char *program) {
+  printf("Usage: %s users_file pages_file controversy_file"
+         " [userids_file] [--page-users threads] [--compress-pages]\n",
+         program);
+}
+
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    printf("Usage: %s users_file pages_file controversy_file\n",
-           argv[0]);
+  // Positional arguments come first; options follow them.
+  int num_positional = 1;
+  while (num_positional < argc
+         && strncmp(argv[num_positional], "--", 2) != 0) {
+    ++num_positional;
+  }
+  int page_users_threads = 0;
+  int compress_pages = 0;
+  for (int i = num_positional; i < argc; ++i) {
+    if (strcmp(argv[i], "--page-users") == 0 && i + 1 < argc) {
+      page_users_threads = atoi(argv[++i]);
+      if (page_users_threads < 1) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--compress-pages") == 0) {
+      compress_pages = 1;
+    } else {
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+  argc = num_positional;
+  if (argc != 4 && argc != 5) {
+    print_usage(argv[0]);
     exit(1);
   }
   if (strcmp(argv[1], "_") != 0) {
@@ -307,5 +533,15 @@ int main(int argc, char **argv) {
   if (strcmp(argv[3], "_") != 0) {
     transcribe_controversy(argv[3], "controversy_mmap");
   }
+  if (argc == 5 && strcmp(argv[4], "_") != 0) {
+    transcribe_userids(argv[4], "userids_bin");
+  }
+  if (page_users_threads > 0) {
+    transcribe_page_users("users_mmap", "page_users_mmap",
+                          page_users_threads);
+  }
+  if (compress_pages) {
+    write_block_store("pages_mmap", "pages_blocks");
+  }
   return 0;
 }
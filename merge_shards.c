@@ -0,0 +1,86 @@
+/* Combine the per-thread outputs of one or more cc_mmap shards into a
+   single file, optionally sorted by the leading userid of each
+   line. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+struct line {
+  int64_t userid;
+  char *text;
+};
+
+int compare_lines(const void *a, const void *b) {
+  const struct line *first = a;
+  const struct line *second = b;
+  if (first->userid != second->userid) {
+    return first->userid < second->userid ? -1 : 1;
+  }
+  return strcmp(first->text, second->text);
+}
+
+int main(int argc, char **argv) {
+  int sort = 0;
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "--sort") == 0) {
+    sort = 1;
+    ++arg;
+  }
+  if (argc - arg < 2) {
+    printf("Usage: %s [--sort] output_file input_files...\n", argv[0]);
+    return 1;
+  }
+  const char *output_name = argv[arg++];
+  FILE *output = fopen(output_name, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Could not open %s for writing\n", output_name);
+    return 1;
+  }
+  struct line *lines = NULL;
+  int64_t num_lines = 0;
+  int64_t max_lines = 0;
+  char *buffer = NULL;
+  size_t buffer_size = 0;
+  ssize_t length;
+  for (; arg < argc; ++arg) {
+    FILE *input = fopen(argv[arg], "r");
+    if (input == NULL) {
+      fprintf(stderr, "Could not open %s\n", argv[arg]);
+      return 1;
+    }
+    while ((length = getline(&buffer, &buffer_size, input)) != -1) {
+      if (length == 0 || buffer[length - 1] != '\n') {
+        // Truncated record from an interrupted shard
+        fprintf(stderr, "Skipping partial line at end of %s\n", argv[arg]);
+        continue;
+      }
+      if (!sort) {
+        fwrite(buffer, 1, length, output);
+        continue;
+      }
+      if (num_lines == max_lines) {
+        max_lines = max_lines == 0 ? 1024 : 2 * max_lines;
+        lines = realloc(lines, max_lines * sizeof(struct line));
+      }
+      lines[num_lines].userid = strtoll(buffer, NULL, 10);
+      lines[num_lines].text = strdup(buffer);
+      ++num_lines;
+    }
+    fclose(input);
+  }
+  if (sort) {
+    qsort(lines, num_lines, sizeof(struct line), compare_lines);
+    for (int64_t i = 0; i < num_lines; ++i) {
+      fputs(lines[i].text, output);
+      free(lines[i].text);
+    }
+    free(lines);
+  }
+  free(buffer);
+  fclose(output);
+  return 0;
+}
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "metrics.h"
+#include "read_mmap.h"
+#include "batch.h"
+
+static const char *metric_names[NUM_METRICS] = {
+  "cosine",
+  "jsd",
+  "jaccard",
+  "weighted-overlap"
+};
+
+int parse_metric(const char *name, enum metric *metric) {
+  for (int i = 0; i < NUM_METRICS; ++i) {
+    if (strcmp(name, metric_names[i]) == 0) {
+      *metric = (enum metric)i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char *metric_name(enum metric metric) {
+  assert(metric >= 0 && metric < NUM_METRICS);
+  return metric_names[metric];
+}
+
+int metric_needs_sum(enum metric metric) {
+  return metric == METRIC_JSD || metric == METRIC_WEIGHTED_OVERLAP;
+}
+
+void resolve_page_vector(struct page_vector *vector, const char *pages_mfile,
+                         const struct mmap_item *page, int needs_sum) {
+  resolve_page_features(vector, get_features(pages_mfile, page), page,
+                        needs_sum);
+}
+
+void resolve_page_features(struct page_vector *vector,
+                           const struct mmap_feature *features,
+                           const struct mmap_item *page, int needs_sum) {
+  vector->features = features;
+  vector->count = page->count_features;
+  vector->norm = page->sum_or_norm;
+  vector->sum = 0.0;
+  if (needs_sum && vector->features != NULL) {
+    for (int64_t i = 0; i < vector->count; ++i) {
+      vector->sum += vector->features[i].feature_value;
+    }
+  }
+}
+
+/* Cosine similarity of the feature vectors. */
+static inline double cosine_kernel(const struct page_vector *first,
+                                   const struct page_vector *second) {
+  if (first->features == NULL || second->features == NULL) {
+    return 0.0;
+  }
+  const struct mmap_feature *first_features = first->features;
+  const struct mmap_feature *second_features = second->features;
+  int64_t first_i = 0;
+  int64_t second_i = 0;
+  double inner_product = 0.0;
+  while (first_i < first->count && second_i < second->count) {
+    int64_t first_feature_num = first_features[first_i].feature_number;
+    int64_t second_feature_num = second_features[second_i].feature_number;
+    if (first_feature_num == second_feature_num) {
+      inner_product += first_features[first_i].feature_value
+          * second_features[second_i].feature_value;
+      ++first_i;
+      ++second_i;
+    } else if (first_feature_num < second_feature_num) {
+      ++first_i;
+    } else {
+      ++second_i;
+    }
+  }
+  return div_ignore_zero(inner_product, first->norm * second->norm);
+}
+
+/* One minus the Jensen-Shannon divergence of the feature vectors, each
+   normalized to a probability distribution. */
+static inline double jsd_kernel(const struct page_vector *first,
+                                const struct page_vector *second) {
+  if (first->features == NULL || second->features == NULL) {
+    return 0.0;
+  }
+  const struct mmap_feature *first_features = first->features;
+  const struct mmap_feature *second_features = second->features;
+  double first_sum = first->sum;
+  double second_sum = second->sum;
+  double first_entropy = 0.0;
+  double second_entropy = 0.0;
+  double combined_entropy = 0.0;
+  int64_t first_i = 0;
+  int64_t second_i = 0;
+  int64_t first_feature_num;
+  int64_t second_feature_num;
+  double first_feature_value;
+  double second_feature_value;
+  while (first_i < first->count || second_i < second->count) {
+    if (first_i < first->count) {
+      first_feature_num = first_features[first_i].feature_number;
+    } else {
+      first_feature_num = INT64_MAX;
+    }
+    if (second_i < second->count) {
+      second_feature_num = second_features[second_i].feature_number;
+    } else {
+      second_feature_num = INT64_MAX;
+    }
+    if (first_feature_num == second_feature_num) {
+      first_feature_value = first_features[first_i].feature_value;
+      second_feature_value = second_features[second_i].feature_value;
+      ++first_i;
+      ++second_i;
+    } else if (first_feature_num < second_feature_num) {
+      first_feature_value = first_features[first_i].feature_value;
+      second_feature_value = 0.0;
+      ++first_i;
+    } else {
+      first_feature_value = 0.0;
+      second_feature_value = second_features[second_i].feature_value;
+      ++second_i;
+    }
+    first_feature_value /= first_sum;
+    second_feature_value /= second_sum;
+    if (first_feature_value > 0.0) {
+      first_entropy += first_feature_value * log2(first_feature_value);
+    }
+    if (second_feature_value > 0.0) {
+      second_entropy += second_feature_value * log2(second_feature_value);
+    }
+    if (first_feature_value > 0.0 || second_feature_value > 0.0) {
+      double combined_value = (first_feature_value
+                               + second_feature_value) / 2.0;
+      combined_entropy += combined_value * log2(combined_value);
+    }
+  }
+  // We take the -1 from entropy into account here
+  return 1.0 - ((first_entropy + second_entropy) / 2.0 - combined_entropy);
+}
+
+/* Size of the intersection of the feature sets over the size of their
+   union. Feature values are ignored. */
+static inline double jaccard_kernel(const struct page_vector *first,
+                                    const struct page_vector *second) {
+  if (first->features == NULL || second->features == NULL) {
+    return 0.0;
+  }
+  const struct mmap_feature *first_features = first->features;
+  const struct mmap_feature *second_features = second->features;
+  int64_t first_i = 0;
+  int64_t second_i = 0;
+  int64_t intersection = 0;
+  while (first_i < first->count && second_i < second->count) {
+    int64_t first_feature_num = first_features[first_i].feature_number;
+    int64_t second_feature_num = second_features[second_i].feature_number;
+    if (first_feature_num == second_feature_num) {
+      ++intersection;
+      ++first_i;
+      ++second_i;
+    } else if (first_feature_num < second_feature_num) {
+      ++first_i;
+    } else {
+      ++second_i;
+    }
+  }
+  return div_ignore_zero(
+      (double)intersection,
+      (double)(first->count + second->count - intersection));
+}
+
+/* Weighted Jaccard (Ruzicka) similarity: the sum of the element-wise
+   minimum of the feature values over the sum of their maximum. The
+   maximum is derived from the page sums, so only the intersection is
+   walked. */
+static inline double weighted_overlap_kernel(
+    const struct page_vector *first, const struct page_vector *second) {
+  if (first->features == NULL || second->features == NULL) {
+    return 0.0;
+  }
+  const struct mmap_feature *first_features = first->features;
+  const struct mmap_feature *second_features = second->features;
+  int64_t first_i = 0;
+  int64_t second_i = 0;
+  double min_sum = 0.0;
+  while (first_i < first->count && second_i < second->count) {
+    int64_t first_feature_num = first_features[first_i].feature_number;
+    int64_t second_feature_num = second_features[second_i].feature_number;
+    if (first_feature_num == second_feature_num) {
+      double first_value = first_features[first_i].feature_value;
+      double second_value = second_features[second_i].feature_value;
+      min_sum += first_value < second_value ? first_value : second_value;
+      ++first_i;
+      ++second_i;
+    } else if (first_feature_num < second_feature_num) {
+      ++first_i;
+    } else {
+      ++second_i;
+    }
+  }
+  return div_ignore_zero(min_sum, first->sum + second->sum - min_sum);
+}
+
+/* Defines build_edges_<name>, an edge_builder_fn with kernel inlined.
+   The uncached loop is kept separate so that it carries no cache
+   checks. */
+#define DEFINE_EDGE_BUILDER(name, kernel)                               \
+  static int64_t build_edges_##name(struct dense_graph graph,          \
+                                    const struct page_vector *pages,   \
+                                    struct sim_cache *cache,           \
+                                    const int *cache_index) {          \
+    int n = graph.num_nodes;                                            \
+    double *edges = graph.edges;                                        \
+    if (cache == NULL) {                                                \
+      for (int i = 0; i < n; ++i) {                                     \
+        for (int j = i + 1; j < n; ++j) {                               \
+          double similarity = kernel(pages + i, pages + j);             \
+          edges[(size_t)n * i + j] = similarity;                        \
+          edges[(size_t)n * j + i] = similarity;                        \
+        }                                                               \
+      }                                                                 \
+      return (int64_t)n * (n - 1) / 2;                                  \
+    }                                                                   \
+    int64_t evaluations = 0;                                            \
+    size_t cache_size = cache->num_pages;                               \
+    for (int i = 0; i < n; ++i) {                                       \
+      double *cache_row = cache->similarities                           \
+          + cache_size * cache_index[i];                                \
+      for (int j = i + 1; j < n; ++j) {                                 \
+        double similarity = cache_row[cache_index[j]];                  \
+        if (isnan(similarity)) {                                        \
+          similarity = kernel(pages + i, pages + j);                    \
+          ++evaluations;                                                \
+          cache_row[cache_index[j]] = similarity;                       \
+          cache->similarities[cache_size * cache_index[j]               \
+                              + cache_index[i]] = similarity;           \
+        }                                                               \
+        edges[(size_t)n * i + j] = similarity;                          \
+        edges[(size_t)n * j + i] = similarity;                          \
+      }                                                                 \
+    }                                                                   \
+    return evaluations;                                                 \
+  }
+
+/* Defines build_row_<name>, a row_builder_fn with kernel inlined. */
+#define DEFINE_ROW_BUILDER(name, kernel)                                \
+  static void build_row_##name(const struct page_vector *pages, int n,  \
+                               int i, double *row) {                    \
+    for (int j = i + 1; j < n; ++j) {                                   \
+      row[j - i - 1] = kernel(pages + i, pages + j);                    \
+    }                                                                   \
+  }
+
+DEFINE_EDGE_BUILDER(cosine, cosine_kernel)
+DEFINE_EDGE_BUILDER(jsd, jsd_kernel)
+DEFINE_EDGE_BUILDER(jaccard, jaccard_kernel)
+DEFINE_EDGE_BUILDER(weighted_overlap, weighted_overlap_kernel)
+DEFINE_ROW_BUILDER(cosine, cosine_kernel)
+DEFINE_ROW_BUILDER(jsd, jsd_kernel)
+DEFINE_ROW_BUILDER(jaccard, jaccard_kernel)
+DEFINE_ROW_BUILDER(weighted_overlap, weighted_overlap_kernel)
+
+/* Cosine similarity and JSD from a single walk over the union of the
+   two feature lists. Bit-for-bit identical to the separate kernels. */
+static inline void cosine_jsd_kernel(const struct page_vector *first,
+                                     const struct page_vector *second,
+                                     double *cosine, double *jsd) {
+  if (first->features == NULL || second->features == NULL) {
+    *cosine = 0.0;
+    *jsd = 0.0;
+    return;
+  }
+  const struct mmap_feature *first_features = first->features;
+  const struct mmap_feature *second_features = second->features;
+  double first_sum = first->sum;
+  double second_sum = second->sum;
+  double inner_product = 0.0;
+  double first_entropy = 0.0;
+  double second_entropy = 0.0;
+  double combined_entropy = 0.0;
+  int64_t first_i = 0;
+  int64_t second_i = 0;
+  int64_t first_feature_num;
+  int64_t second_feature_num;
+  double first_feature_value;
+  double second_feature_value;
+  while (first_i < first->count || second_i < second->count) {
+    if (first_i < first->count) {
+      first_feature_num = first_features[first_i].feature_number;
+    } else {
+      first_feature_num = INT64_MAX;
+    }
+    if (second_i < second->count) {
+      second_feature_num = second_features[second_i].feature_number;
+    } else {
+      second_feature_num = INT64_MAX;
+    }
+    if (first_feature_num == second_feature_num) {
+      first_feature_value = first_features[first_i].feature_value;
+      second_feature_value = second_features[second_i].feature_value;
+      inner_product += first_feature_value * second_feature_value;
+      ++first_i;
+      ++second_i;
+    } else if (first_feature_num < second_feature_num) {
+      first_feature_value = first_features[first_i].feature_value;
+      second_feature_value = 0.0;
+      ++first_i;
+    } else {
+      first_feature_value = 0.0;
+      second_feature_value = second_features[second_i].feature_value;
+      ++second_i;
+    }
+    first_feature_value /= first_sum;
+    second_feature_value /= second_sum;
+    if (first_feature_value > 0.0) {
+      first_entropy += first_feature_value * log2(first_feature_value);
+    }
+    if (second_feature_value > 0.0) {
+      second_entropy += second_feature_value * log2(second_feature_value);
+    }
+    if (first_feature_value > 0.0 || second_feature_value > 0.0) {
+      double combined_value = (first_feature_value
+                               + second_feature_value) / 2.0;
+      combined_entropy += combined_value * log2(combined_value);
+    }
+  }
+  *cosine = div_ignore_zero(inner_product, first->norm * second->norm);
+  *jsd = 1.0 - ((first_entropy + second_entropy) / 2.0 - combined_entropy);
+}
+
+int64_t build_edges_cosine_jsd(struct dense_graph cosine_graph,
+                               struct dense_graph jsd_graph,
+                               const struct page_vector *pages) {
+  assert(cosine_graph.num_nodes == jsd_graph.num_nodes);
+  int n = cosine_graph.num_nodes;
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j) {
+      double cosine, jsd;
+      cosine_jsd_kernel(pages + i, pages + j, &cosine, &jsd);
+      cosine_graph.edges[(size_t)n * i + j] = cosine;
+      cosine_graph.edges[(size_t)n * j + i] = cosine;
+      jsd_graph.edges[(size_t)n * i + j] = jsd;
+      jsd_graph.edges[(size_t)n * j + i] = jsd;
+    }
+  }
+  return (int64_t)n * (n - 1) / 2;
+}
+
+edge_builder_fn edge_builder(enum metric metric) {
+  switch (metric) {
+    case METRIC_COSINE:
+      return build_edges_cosine;
+    case METRIC_JSD:
+      return build_edges_jsd;
+    case METRIC_JACCARD:
+      return build_edges_jaccard;
+    case METRIC_WEIGHTED_OVERLAP:
+      return build_edges_weighted_overlap;
+    default:
+      assert(0);
+      return NULL;
+  }
+}
+
+row_builder_fn row_builder(enum metric metric) {
+  switch (metric) {
+    case METRIC_COSINE:
+      return build_row_cosine;
+    case METRIC_JSD:
+      return build_row_jsd;
+    case METRIC_JACCARD:
+      return build_row_jaccard;
+    case METRIC_WEIGHTED_OVERLAP:
+      return build_row_weighted_overlap;
+    default:
+      assert(0);
+      return NULL;
+  }
+}
+
+double page_similarity(enum metric metric, const char *pages_mfile,
+                       const struct mmap_item *first_page,
+                       const struct mmap_item *second_page) {
+  struct page_vector pages[2];
+  resolve_page_vector(pages, pages_mfile, first_page,
+                      metric_needs_sum(metric));
+  resolve_page_vector(pages + 1, pages_mfile, second_page,
+                      metric_needs_sum(metric));
+  switch (metric) {
+    case METRIC_COSINE:
+      return cosine_kernel(pages, pages + 1);
+    case METRIC_JSD:
+      return jsd_kernel(pages, pages + 1);
+    case METRIC_JACCARD:
+      return jaccard_kernel(pages, pages + 1);
+    case METRIC_WEIGHTED_OVERLAP:
+      return weighted_overlap_kernel(pages, pages + 1);
+    default:
+      assert(0);
+      return 0.0;
+  }
+}
@@ -0,0 +1,90 @@
+/* Page similarity metrics. The metric is chosen at run time, once per
+   work item: each metric has its own edge-construction loop with the
+   similarity kernel inlined, so the choice costs nothing per page
+   pair. */
+
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "compute_scores.h"
+
+struct mmap_item;
+struct mmap_feature;
+struct sim_cache;
+
+enum metric {
+  METRIC_COSINE,
+  METRIC_JSD,
+  METRIC_JACCARD,
+  METRIC_WEIGHTED_OVERLAP,
+  NUM_METRICS
+};
+
+/* A page's feature list, resolved once per work item so the kernels
+   never go back to the memory map for item headers. */
+struct page_vector {
+  const struct mmap_feature *features;
+  int64_t count;
+  /* L2 norm, as stored in pages_mmap. */
+  double norm;
+  /* Sum of the feature values; only filled in when
+     metric_needs_sum(). */
+  double sum;
+};
+
+/* Fill in every edge of graph from the similarities of pages, which
+   holds graph.num_nodes entries. If cache is not NULL, similarities are
+   read from and added to it, with cache_index giving each page's
+   position in the cache. Returns the number of similarities
+   evaluated. */
+typedef int64_t (*edge_builder_fn)(struct dense_graph graph,
+                                   const struct page_vector *pages,
+                                   struct sim_cache *cache,
+                                   const int *cache_index);
+
+/* Fill row[j - i - 1] with the similarity of pages i and j for every
+   j in (i, n): row i of the packed upper triangle (see
+   packed_row_offset). */
+typedef void (*row_builder_fn)(const struct page_vector *pages, int n, int i,
+                               double *row);
+
+static inline double div_ignore_zero(double x, double y) {
+  if (y == 0.0) {
+    assert(x == 0.0);
+    return 0.0;
+  } else {
+    return x / y;
+  }
+}
+
+/* Returns 0 if name is not a known metric. */
+int parse_metric(const char *name, enum metric *metric);
+const char *metric_name(enum metric metric);
+int metric_needs_sum(enum metric metric);
+edge_builder_fn edge_builder(enum metric metric);
+row_builder_fn row_builder(enum metric metric);
+
+/* Fill the edges of both graphs, which share their nodes, in one walk
+   over each page pair's features: cosine similarities into
+   cosine_graph and JSD into jsd_graph. pages need their sums. Returns
+   the number of page pairs evaluated. */
+int64_t build_edges_cosine_jsd(struct dense_graph cosine_graph,
+                               struct dense_graph jsd_graph,
+                               const struct page_vector *pages);
+
+void resolve_page_vector(struct page_vector *vector, const char *pages_mfile,
+                         const struct mmap_item *page, int needs_sum);
+/* As resolve_page_vector, for features already found elsewhere, such
+   as in a block cache. */
+void resolve_page_features(struct page_vector *vector,
+                           const struct mmap_feature *features,
+                           const struct mmap_item *page, int needs_sum);
+/* Similarity of a single pair of pages, for tools and tests. */
+double page_similarity(enum metric metric, const char *pages_mfile,
+                       const struct mmap_item *first_page,
+                       const struct mmap_item *second_page);
+
+#endif
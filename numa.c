@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "numa.h"
+
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+#define LIST_BUFFER_SIZE 4096
+
+/* Parse a sysfs list such as "0-3,8,10-11". Returns the number of
+   entries, writing up to max_values of them to values (values may be
+   NULL to only count). */
+static int parse_sysfs_list(const char *list, int *values, int max_values) {
+  int count = 0;
+  const char *s = list;
+  while (*s != '\0' && *s != '\n') {
+    char *end;
+    long first = strtol(s, &end, 10);
+    if (end == s) {
+      break;
+    }
+    long last = first;
+    s = end;
+    if (*s == '-') {
+      ++s;
+      last = strtol(s, &end, 10);
+      s = end;
+    }
+    for (long v = first; v <= last; ++v) {
+      if (values != NULL && count < max_values) {
+        values[count] = (int)v;
+      }
+      ++count;
+    }
+    if (*s == ',') {
+      ++s;
+    }
+  }
+  return count;
+}
+
+static int read_sysfs_file(const char *path, char *buffer, int size) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  int ok = fgets(buffer, size, fp) != NULL;
+  fclose(fp);
+  return ok;
+}
+
+static void single_node_topology(struct numa_topology *topology) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus < 1) {
+    num_cpus = 1;
+  }
+  topology->num_nodes = 1;
+  topology->node_ids[0] = 0;
+  topology->num_cpus[0] = (int)num_cpus;
+  topology->cpus[0] = malloc(sizeof(int) * num_cpus);
+  for (int i = 0; i < num_cpus; ++i) {
+    topology->cpus[0][i] = i;
+  }
+}
+
+void read_numa_topology(struct numa_topology *topology) {
+  char buffer[LIST_BUFFER_SIZE];
+  char path[256];
+  topology->num_nodes = 0;
+  if (!read_sysfs_file(SYSFS_NODE_DIR "/online", buffer, LIST_BUFFER_SIZE)) {
+    single_node_topology(topology);
+    return;
+  }
+  int node_ids[MAX_NUMA_NODES];
+  int num_nodes = parse_sysfs_list(buffer, node_ids, MAX_NUMA_NODES);
+  if (num_nodes > MAX_NUMA_NODES) {
+    num_nodes = MAX_NUMA_NODES;
+  }
+  for (int i = 0; i < num_nodes; ++i) {
+    snprintf(path, sizeof(path), SYSFS_NODE_DIR "/node%d/cpulist",
+             node_ids[i]);
+    if (!read_sysfs_file(path, buffer, LIST_BUFFER_SIZE)) {
+      continue;
+    }
+    int num_cpus = parse_sysfs_list(buffer, NULL, 0);
+    if (num_cpus == 0) {
+      // Memory-only node
+      continue;
+    }
+    int n = topology->num_nodes;
+    topology->node_ids[n] = node_ids[i];
+    topology->num_cpus[n] = num_cpus;
+    topology->cpus[n] = malloc(sizeof(int) * num_cpus);
+    parse_sysfs_list(buffer, topology->cpus[n], num_cpus);
+    ++topology->num_nodes;
+  }
+  if (topology->num_nodes == 0) {
+    single_node_topology(topology);
+  }
+}
+
+void free_numa_topology(struct numa_topology *topology) {
+  for (int i = 0; i < topology->num_nodes; ++i) {
+    free(topology->cpus[i]);
+    topology->cpus[i] = NULL;
+  }
+  topology->num_nodes = 0;
+}
+
+void set_thread_cpu(pthread_attr_t *attr, int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpus);
+}
+
+struct replicate_task {
+  const char *src;
+  int64_t length;
+  char *dest;
+};
+
+static void* replicate_thread(void *arg) {
+  struct replicate_task *task = arg;
+  task->dest = mmap(NULL, task->length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (task->dest == MAP_FAILED) {
+    fprintf(stderr, "Could not allocate %" PRId64 " bytes for replica\n",
+            task->length);
+    exit(1);
+  }
+  // First touch happens here, on a CPU of the target node.
+  memcpy(task->dest, task->src, task->length);
+  mprotect(task->dest, task->length, PROT_READ);
+  return NULL;
+}
+
+const char *replicate_on_node(const struct numa_topology *topology,
+                              int node, const char *src, int64_t length) {
+  assert(node >= 0 && node < topology->num_nodes);
+  struct replicate_task task;
+  task.src = src;
+  task.length = length;
+  task.dest = NULL;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int i = 0; i < topology->num_cpus[node]; ++i) {
+    CPU_SET(topology->cpus[node][i], &cpus);
+  }
+  pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+  pthread_t pth;
+  pthread_create(&pth, &attr, replicate_thread, &task);
+  pthread_join(pth, NULL);
+  pthread_attr_destroy(&attr);
+  return task.dest;
+}
+
+void free_replica(const char *replica, int64_t length) {
+  munmap((void*)replica, length);
+}
@@ -0,0 +1,36 @@
+/* NUMA topology discovery, thread placement, and per-node replication
+   of read-only memory maps. Topology is read from sysfs, so no libnuma
+   is needed; on machines without NUMA information everything is
+   reported as a single node containing every online CPU. */
+
+#ifndef __numa_h__
+#define __numa_h__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_NUMA_NODES 64
+
+struct numa_topology {
+  int num_nodes;
+  int node_ids[MAX_NUMA_NODES];
+  int num_cpus[MAX_NUMA_NODES];
+  int *cpus[MAX_NUMA_NODES];
+};
+
+/* Fill topology from /sys/devices/system/node. Always succeeds, falling
+   back to a single node. */
+void read_numa_topology(struct numa_topology *topology);
+void free_numa_topology(struct numa_topology *topology);
+
+/* Set attr so that the created thread runs only on the given CPU. */
+void set_thread_cpu(pthread_attr_t *attr, int cpu);
+
+/* Copy length bytes of src into anonymous memory whose pages are
+   first touched by a thread running on node (index into topology), so
+   the kernel places them on that node. */
+const char *replicate_on_node(const struct numa_topology *topology,
+                              int node, const char *src, int64_t length);
+void free_replica(const char *replica, int64_t length);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "page_stats.h"
+#include "read_mmap.h"
+
+void accumulate_page_stats(struct page_aggregate *aggregates,
+                           int64_t num_pages, struct dense_graph graph) {
+  for (int i = 0; i < graph.num_nodes; ++i) {
+    const struct node_info *node = graph.nodes + i;
+    assert(node->real_id >= 0 && node->real_id < num_pages);
+    double clustering = node->denominator == 0.0
+        ? 0.0 : node->numerator / node->denominator;
+    struct page_aggregate *aggregate = aggregates + node->real_id;
+    ++aggregate->num_items;
+    aggregate->clustering_sum += clustering;
+    aggregate->weighted_clustering_sum += node->edits * clustering;
+    aggregate->weight_sum += node->edits;
+  }
+}
+
+void merge_page_stats(struct page_aggregate *into,
+                      const struct page_aggregate *from, int64_t num_pages) {
+  for (int64_t i = 0; i < num_pages; ++i) {
+    into[i].num_items += from[i].num_items;
+    into[i].clustering_sum += from[i].clustering_sum;
+    into[i].weighted_clustering_sum += from[i].weighted_clustering_sum;
+    into[i].weight_sum += from[i].weight_sum;
+  }
+}
+
+void write_page_stats(const char *file_name,
+                      const struct page_aggregate *aggregates,
+                      int64_t num_pages) {
+  FILE *out = fopen(file_name, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open %s for writing\n", file_name);
+    exit(1);
+  }
+  struct mmap_header header;
+  header.data_offset = sizeof(struct mmap_header);
+  header.item_count = num_pages;
+  fwrite(&header, sizeof(header), 1, out);
+  fwrite(aggregates, sizeof(struct page_aggregate), num_pages, out);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Could not write %s\n", file_name);
+    exit(1);
+  }
+}
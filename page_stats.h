@@ -0,0 +1,40 @@
+/* Per-page aggregates over every scored item, computed in place of
+   parsing raw_page_stats_out downstream. Each thread accumulates into
+   its own array, indexed by pageid and sized from controversy_mmap,
+   and the arrays are summed when scoring finishes. The result is
+   written as page_stats_mmap: an mmap_header followed by one
+   page_aggregate per pageid. The aggregates are sums, so the files of
+   several shards can be combined by adding them. */
+
+#ifndef __page_stats_h__
+#define __page_stats_h__
+
+#include <stdint.h>
+
+#include "compute_scores.h"
+
+struct page_aggregate {
+  /* Items whose graph contained the page. */
+  int64_t num_items;
+  /* Sum of the page's clustering over those items; divided by
+     num_items, the mean clustering. */
+  double clustering_sum;
+  /* Sum of clustering times the item's edit fraction on the page, and
+     of the edit fractions; their ratio is the edit-weighted mean
+     clustering. */
+  double weighted_clustering_sum;
+  double weight_sum;
+};
+
+/* Add the nodes of a scored graph, whose accumulators are filled in,
+   to aggregates. */
+void accumulate_page_stats(struct page_aggregate *aggregates,
+                           int64_t num_pages, struct dense_graph graph);
+/* Add from into into, element by element. */
+void merge_page_stats(struct page_aggregate *into,
+                      const struct page_aggregate *from, int64_t num_pages);
+void write_page_stats(const char *file_name,
+                      const struct page_aggregate *aggregates,
+                      int64_t num_pages);
+
+#endif
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "prefetch.h"
+#include "read_mmap.h"
+#include "queue.h"
+#include "block_store.h"
+
+void init_prefetcher(struct prefetcher *p, const char *mmap_users,
+                     const struct mmap_item *users, int64_t num_users,
+                     const char *mmap_pages, int64_t mmap_pages_size,
+                     struct queue *input, emit_work_fn emit,
+                     void *emit_context) {
+  p->mmap_users = mmap_users;
+  p->users = users;
+  p->num_users = num_users;
+  p->mmap_pages = mmap_pages;
+  p->pages = get_items(mmap_pages, &p->num_pages);
+  p->blocks = NULL;
+  if (get_block_store(mmap_pages) != NULL) {
+    int64_t num_blocks;
+    p->blocks = get_blocks(mmap_pages, &num_blocks);
+  }
+  p->mmap_pages_size = mmap_pages_size;
+  p->input = input;
+  p->emit = emit;
+  p->emit_context = emit_context;
+  p->system_page_size = (size_t)sysconf(_SC_PAGESIZE);
+  p->residency_size = 0;
+  p->residency = NULL;
+  p->num_items = 0;
+  p->bytes_advised = 0;
+  p->pages_missing = 0;
+}
+
+/* Count the non-resident memory pages of [start, end), which are
+   page aligned offsets into pages_mmap, then advise them. */
+static void advise_range(struct prefetcher *p, size_t start, size_t end) {
+  if (end > (size_t)p->mmap_pages_size) {
+    end = (size_t)p->mmap_pages_size;
+  }
+  if (start >= end) {
+    return;
+  }
+  char *address = (char*)p->mmap_pages + start;
+  size_t length = end - start;
+  size_t num_pages = (length + p->system_page_size - 1) / p->system_page_size;
+  if (num_pages > p->residency_size) {
+    p->residency_size = num_pages;
+    p->residency = realloc(p->residency, num_pages);
+  }
+  if (mincore(address, length, p->residency) == 0) {
+    for (size_t i = 0; i < num_pages; ++i) {
+      if (!(p->residency[i] & 1)) {
+        ++p->pages_missing;
+      }
+    }
+  }
+  madvise(address, length, MADV_WILLNEED);
+  p->bytes_advised += length;
+}
+
+/* Advise the feature lists of a sorted list of pages. The lists lie in
+   pages_mmap in page order, so neighboring ones are merged into a
+   single range when they share or abut a memory page. In a block
+   store, a page's whole compressed block is advised. */
+static void prefetch_pages(struct prefetcher *p,
+                           const struct mmap_feature *user_pages,
+                           int64_t count) {
+  size_t page_mask = ~(p->system_page_size - 1);
+  size_t range_start = 0;
+  size_t range_end = 0;
+  for (int64_t i = 0; i < count; ++i) {
+    int64_t page_num = user_pages[i].feature_number;
+    if (page_num < 0 || page_num >= p->num_pages) {
+      continue;
+    }
+    const struct mmap_item *page = p->pages + page_num;
+    if (page->features_offset == 0 || page->count_features == 0) {
+      continue;
+    }
+    size_t offset = (size_t)page->features_offset;
+    size_t size = page->count_features * sizeof(struct mmap_feature);
+    if (p->blocks != NULL) {
+      const struct block_info *block = p->blocks + page_block(page);
+      offset = (size_t)block->data_offset;
+      size = (size_t)block->data_size;
+    }
+    size_t start = offset & page_mask;
+    size_t end = offset + size;
+    end = (end + p->system_page_size - 1) & page_mask;
+    if (range_end > range_start && start <= range_end) {
+      if (end > range_end) {
+        range_end = end;
+      }
+      continue;
+    }
+    advise_range(p, range_start, range_end);
+    range_start = start;
+    range_end = end;
+  }
+  advise_range(p, range_start, range_end);
+}
+
+static void prefetch_item(struct prefetcher *p,
+                          const struct user_group *work) {
+  for (; work != NULL; work = work->next) {
+    if (work->pages != NULL) {
+      prefetch_pages(p, work->pages, work->num_pages);
+      continue;
+    }
+    for (int i = 0; i < work->num_users; ++i) {
+      if (work->userids[i] >= p->num_users) {
+        continue;
+      }
+      const struct mmap_item *user = p->users + work->userids[i];
+      const struct mmap_feature *user_pages = get_features(p->mmap_users,
+                                                           user);
+      if (user_pages != NULL) {
+        prefetch_pages(p, user_pages, user->count_features);
+      }
+    }
+  }
+}
+
+void *run_prefetcher(void *prefetcher) {
+  struct prefetcher *p = prefetcher;
+  struct user_group *work;
+  while ((work = pop_front(p->input)) != NULL) {
+    prefetch_item(p, work);
+    ++p->num_items;
+    p->emit(work, p->emit_context);
+  }
+  return NULL;
+}
+
+void free_prefetcher(struct prefetcher *p) {
+  free(p->residency);
+}
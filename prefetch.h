@@ -0,0 +1,54 @@
+/* Readahead for upcoming work items. A helper thread takes items on
+   their way from the reader to the workers, resolves the pages each
+   item will touch through users_mmap, and asks the kernel to start
+   reading those pages' feature lists in pages_mmap (madvise
+   MADV_WILLNEED) before passing the item on. The worker queues are
+   sized to the lookahead depth, so at most that many items per queue
+   are read ahead of the workers. Before advising, mincore counts the
+   memory pages that are not yet resident: page faults the workers
+   would otherwise have taken. */
+
+#ifndef __prefetch_h__
+#define __prefetch_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "score_thread.h"
+
+struct queue;
+struct block_info;
+
+struct prefetcher {
+  const char *mmap_users;
+  const struct mmap_item *users;
+  int64_t num_users;
+  const char *mmap_pages;
+  const struct mmap_item *pages;
+  int64_t num_pages;
+  int64_t mmap_pages_size;
+  /* The block table if mmap_pages is a block store, or NULL. */
+  const struct block_info *blocks;
+  /* Items from the reader, ending with NULL. */
+  struct queue *input;
+  emit_work_fn emit;
+  void *emit_context;
+  size_t system_page_size;
+  unsigned char *residency;
+  size_t residency_size;
+  int64_t num_items;
+  int64_t bytes_advised;
+  /* Memory pages found not resident before being advised. */
+  int64_t pages_missing;
+};
+
+void init_prefetcher(struct prefetcher *p, const char *mmap_users,
+                     const struct mmap_item *users, int64_t num_users,
+                     const char *mmap_pages, int64_t mmap_pages_size,
+                     struct queue *input, emit_work_fn emit,
+                     void *emit_context);
+/* Thread body: prefetch and emit items until a NULL item arrives. */
+void *run_prefetcher(void *prefetcher);
+void free_prefetcher(struct prefetcher *p);
+
+#endif
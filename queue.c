@@ -9,9 +9,9 @@ void push_back(struct queue* q, VALUE_TYPE value) {
   q->last = (q->last + 1) % q->max_size;
   q->values[q->last] = value;
   q->size++;
+  assert(q->size <= q->max_size);
   pthread_mutex_unlock(&q->lock);
   sem_post(&q->work_sem);
-  assert(q->size <= q->max_size);
 }
 
 VALUE_TYPE pop_front(struct queue* q) {
@@ -20,9 +20,9 @@ VALUE_TYPE pop_front(struct queue* q) {
   VALUE_TYPE ret = *(q->values + q->first);
   q->first = (q->first + 1) % q->max_size;
   q->size--;
+  assert(q->size >= 0);
   pthread_mutex_unlock(&q->lock);
   sem_post(&q->free_space_sem);
-  assert(q->size >= 0);
   return ret;
 }
 
@@ -35,12 +35,19 @@ VALUE_TYPE pop_back(struct queue* q) {
     q->last = q->max_size - 1;
   }
   q->size--;
+  assert(q->size >= 0);
   pthread_mutex_unlock(&q->lock);
   sem_post(&q->free_space_sem);
-  assert(q->size >= 0);
   return ret;
 }
 
+int queue_size(struct queue* q) {
+  pthread_mutex_lock(&q->lock);
+  int size = q->size;
+  pthread_mutex_unlock(&q->lock);
+  return size;
+}
+
 struct queue* init_queue(int max_size) {
   struct queue* q = malloc(sizeof(struct queue));
   q->max_size = max_size;
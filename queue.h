@@ -25,6 +25,8 @@ struct queue {
 void push_back(struct queue* q, VALUE_TYPE value);
 VALUE_TYPE pop_front(struct queue* q);
 VALUE_TYPE pop_back(struct queue* q);
+/* Number of values queued, read under the lock. */
+int queue_size(struct queue* q);
 
 struct queue* init_queue(int max_size);
 void free_queue(struct queue* q);
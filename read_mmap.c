@@ -9,6 +9,43 @@
 
 #include "read_mmap.h"
 #include "score_thread.h"
+#include "block_store.h"
+
+#define MAX_BLOCK_STORE_MAPS 16
+
+/* Mappings made by open_mmap_read that hold a block store. Written only
+   while files are opened, before any threads read them. */
+static const char *block_store_maps[MAX_BLOCK_STORE_MAPS];
+static int num_block_store_maps = 0;
+
+static int is_block_store_map(const char *mfile) {
+  for (int i = 0; i < num_block_store_maps; ++i) {
+    if (block_store_maps[i] == mfile) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Record whether the mapping at mfile holds a block store, replacing
+   what was recorded for an earlier mapping at the same address. */
+static void note_block_store_map(const char *mfile, int64_t size) {
+  for (int i = 0; i < num_block_store_maps; ++i) {
+    if (block_store_maps[i] == mfile) {
+      block_store_maps[i] = block_store_maps[--num_block_store_maps];
+      break;
+    }
+  }
+  if (size >= (int64_t)(sizeof(struct mmap_header)
+                        + sizeof(struct block_store_header))
+      && get_block_store(mfile) != NULL) {
+    if (num_block_store_maps == MAX_BLOCK_STORE_MAPS) {
+      fprintf(stderr, "Too many compressed memory maps open\n");
+      exit(1);
+    }
+    block_store_maps[num_block_store_maps++] = mfile;
+  }
+}
 
 const struct mmap_item* get_items(const char* mfile, int64_t* num_items) {
   struct mmap_header* header = (struct mmap_header*)mfile;
@@ -21,6 +58,12 @@ const struct mmap_feature* get_features(const char* mfile,
   if (item->features_offset == 0) {
     return NULL;
   }
+  // A block store's offsets name blocks, not bytes in the file.
+  if (num_block_store_maps > 0 && is_block_store_map(mfile)) {
+    fprintf(stderr, "Features of a compressed memory map can only be read"
+            " through a block cache\n");
+    exit(1);
+  }
   return (const struct mmap_feature*)(mfile + item->features_offset);
 }
 
@@ -51,5 +94,15 @@ const char *open_mmap_read(const char *file_name, int *mmapfd) {
             file_name);
     exit(1);
   }
+  note_block_store_map(mmap_addr, statbuf.st_size);
   return mmap_addr;
 }
+
+int64_t get_mmap_size(int mmapfd) {
+  struct stat statbuf;
+  if (fstat(mmapfd, &statbuf) == -1) {
+    fprintf(stderr, "Could not stat mmap file\n");
+    exit(1);
+  }
+  return statbuf.st_size;
+}
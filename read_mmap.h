@@ -27,9 +27,14 @@ struct mmap_feature {
 };
 
 const struct mmap_item* get_items(const char* mfile, int64_t* num_items);
+/* Exits if mfile was opened with open_mmap_read and is a compressed
+   pages store (see block_store.h), whose features are read with
+   pin_page_features. */
 const struct mmap_feature* get_features(const char* mfile,
                                         const struct mmap_item* item);
 const struct mmap_feature* get_top_level_features(const char* mfile,
                                                   int64_t* num_features);
 const char *open_mmap_read(const char *file_name, int *mmapfd);
+/* Size in bytes of a file opened with open_mmap_read. */
+int64_t get_mmap_size(int mmapfd);
 #endif
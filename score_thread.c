@@ -1,45 +1,76 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <math.h>
+#include <string.h>
+
+#include <sys/resource.h>
 
 #include "compute_scores.h"
 #include "score_thread.h"
 #include "read_mmap.h"
 #include "queue.h"
+#include "checkpoint.h"
+#include "batch.h"
+#include "metrics.h"
+#include "top.h"
+#include "stream.h"
+#include "budget.h"
+#include "arena.h"
+#include "block_cache.h"
+#include "page_stats.h"
+
+/* The merged page vector of the members common to every group in a
+   chain (see batch.h), built once per chain. */
+struct group_core {
+  int num_users;
+  /* Sorted. */
+  int64_t *userids;
+  struct mmap_feature *pages;
+  int64_t num_pages;
+};
+
+int compare_userids(const void *a, const void *b) {
+  int64_t first = *(const int64_t*)a;
+  int64_t second = *(const int64_t*)b;
+  return first < second ? -1 : (first > second ? 1 : 0);
+}
+
+/* A sorted feature list to be merged into a group's page vector. */
+struct feature_source {
+  const struct mmap_feature *features;
+  int64_t count;
+};
 
 struct feature_iterator {
-  const struct user_group *group;
-  int *current_positions;
+  const struct feature_source *sources;
+  int num_sources;
+  int64_t *current_positions;
   int64_t feature_id;
   double feature_value;
-  const struct thread_info *tinfo;
 };
 
-#define USER_BUFFER_SIZE 10000
-
 void init_feature_iterator(struct feature_iterator *it,
-                           const struct user_group *group,
-                           const struct thread_info *tinfo) {
+                           const struct feature_source *sources,
+                           int num_sources, struct arena *arena) {
   it->feature_id = -1;
   it->feature_value = 0.0;
-  it->group = group;
-  it->current_positions = calloc(group->num_users, sizeof(int));
-  it->tinfo = tinfo;
+  it->sources = sources;
+  it->num_sources = num_sources;
+  it->current_positions = arena_calloc(arena,
+                                       num_sources * sizeof(int64_t));
 }
 
 int next_feature(struct feature_iterator *it) {
   it->feature_id = -1;
-  for (int i = 0; i < it->group->num_users; ++i) {
-    assert(it->group->userids[i] < it->tinfo->num_users);
-    const struct mmap_item *user
-        = it->tinfo->users + it->group->userids[i];
-    if (it->current_positions[i] < user->count_features) {
-      const struct mmap_feature *user_pages = get_features(
-          it->tinfo->mmap_users, user);
-      int64_t feature_id = user_pages[
+  for (int i = 0; i < it->num_sources; ++i) {
+    const struct feature_source *source = it->sources + i;
+    if (it->current_positions[i] < source->count) {
+      int64_t feature_id = source->features[
           it->current_positions[i]].feature_number;
       if (it->feature_id == -1 || feature_id < it->feature_id) {
         it->feature_id = feature_id;
@@ -50,151 +81,264 @@ int next_feature(struct feature_iterator *it) {
     return 0;
   }
   it->feature_value = 0.0;
-  for (int i = 0; i < it->group->num_users; ++i) {
-    const struct mmap_item *user
-        = it->tinfo->users + it->group->userids[i];
-    if (it->current_positions[i] < user->count_features) {
-      const struct mmap_feature *user_pages = get_features(
-          it->tinfo->mmap_users, user);
-      if (it->feature_id
-          == user_pages[it->current_positions[i]].feature_number) {
-        it->feature_value += user_pages[
-            it->current_positions[i]].feature_value;
-        ++(it->current_positions[i]);
-      }
+  for (int i = 0; i < it->num_sources; ++i) {
+    const struct feature_source *source = it->sources + i;
+    if (it->current_positions[i] < source->count
+        && it->feature_id
+        == source->features[it->current_positions[i]].feature_number) {
+      it->feature_value += source->features[
+          it->current_positions[i]].feature_value;
+      ++(it->current_positions[i]);
     }
   }
   return 1;
 }
 
 void free_feature_iterator(struct feature_iterator *it) {
-  free(it->current_positions);
+  // current_positions is released with the rest of the item's arena.
   it->current_positions = NULL;
 }
 
-inline double div_ignore_zero(double x, double y) {
-  if (y == 0.0) {
-    assert(x == 0.0);
-    return 0.0;
-  } else {
-    return (double)x / (double)y;
+/* Merge sources into one sorted list, summing the values of equal
+   features, in the space allocated by alloc. Returns the list and sets
+   its length and the sum of its values. positions_arena holds the
+   iterator's positions. */
+struct mmap_feature *merge_sources(const struct feature_source *sources,
+                                   int num_sources,
+                                   struct arena *positions_arena,
+                                   struct arena *list_arena,
+                                   int64_t *count, double *sum) {
+  struct feature_iterator it;
+  init_feature_iterator(&it, sources, num_sources, positions_arena);
+  *count = 0;
+  *sum = 0.0;
+  while (next_feature(&it)) {
+    ++*count;
+    *sum += it.feature_value;
+  }
+  free_feature_iterator(&it);
+  size_t bytes = sizeof(struct mmap_feature) * *count;
+  struct mmap_feature *merged = list_arena != NULL
+      ? arena_alloc(list_arena, bytes) : malloc(bytes);
+  init_feature_iterator(&it, sources, num_sources, positions_arena);
+  int64_t i = 0;
+  while (next_feature(&it)) {
+    assert (i < *count);
+    merged[i].feature_number = it.feature_id;
+    merged[i].feature_value = it.feature_value;
+    ++i;
   }
+  assert (i == *count);
+  free_feature_iterator(&it);
+  return merged;
 }
 
-double JSD(
-    const char *pages_mfile,
-    const struct mmap_item *first_page,
-    const struct mmap_item *second_page) {
-  const struct mmap_feature *first_features = get_features(
-      pages_mfile, first_page);
-  const struct mmap_feature *second_features = get_features(
-      pages_mfile, second_page);
-  if (first_features == NULL || second_features == NULL) {
-    return 0.0;
-  }
-  double first_sum = 0.0;
-  for (int i = 0; i < first_page->count_features; ++i) {
-    first_sum += first_features[i].feature_value;
-  }
-  double second_sum = 0.0;
-  for (int i = 0; i < second_page->count_features; ++i) {
-    second_sum += second_features[i].feature_value;
-  }
-  double first_entropy = 0.0;
-  double second_entropy = 0.0;
-  double combined_entropy = 0.0;
-  int first_i = 0;
-  int second_i = 0;
-  int first_feature_num;
-  int second_feature_num;
-  double first_feature_value;
-  double second_feature_value;
-  while (first_i < first_page->count_features
-         || second_i < second_page->count_features) {
-    if (first_i < first_page->count_features) {
-      first_feature_num = first_features[first_i].feature_number;
-    } else {
-      first_feature_num = INT_MAX;
-    }
-    if (second_i < second_page->count_features) {
-      second_feature_num = second_features[second_i].feature_number;
-    } else {
-      second_feature_num = INT_MAX;
-    }
-    if (first_feature_num == second_feature_num) {
-      first_feature_value = first_features[first_i].feature_value;
-      second_feature_value = second_features[second_i].feature_value;
-      ++first_i;
-      ++second_i;
-    } else if (first_feature_num < second_feature_num) {
-      first_feature_value = first_features[first_i].feature_value;
-      second_feature_value = 0.0;
-      ++first_i;
-    } else {
-      first_feature_value = 0.0;
-      second_feature_value = second_features[second_i].feature_value;
-      ++second_i;
-    }
-    first_feature_value /= first_sum;
-    second_feature_value /= second_sum;
-    if (first_feature_value > 0.0) {
-      first_entropy += first_feature_value * log2(first_feature_value);
+/* A user's pages as a merge source. */
+void user_source(struct feature_source *source, int64_t userid,
+                 const struct thread_info *tinfo) {
+  assert(userid < tinfo->num_users);
+  const struct mmap_item *user = tinfo->users + userid;
+  source->features = get_features(tinfo->mmap_users, user);
+  source->count = source->features != NULL ? user->count_features : 0;
+}
+
+/* Build the merged page vector of the core of a chain of groups (see
+   batch.h). Returns 0 if the chain has no core. */
+int init_group_core(struct group_core *core, const struct user_group *chain,
+                    struct thread_info *tinfo) {
+  core->userids = malloc(chain->num_users * sizeof(int64_t));
+  core->num_users = chain_core(chain, core->userids);
+  if (core->num_users == 0) {
+    free(core->userids);
+    core->userids = NULL;
+    return 0;
+  }
+  struct feature_source *sources = arena_alloc(
+      tinfo->arena, core->num_users * sizeof(struct feature_source));
+  for (int i = 0; i < core->num_users; ++i) {
+    user_source(sources + i, core->userids[i], tinfo);
+  }
+  double sum;
+  core->pages = merge_sources(sources, core->num_users, tinfo->arena, NULL,
+                              &core->num_pages, &sum);
+  tinfo->merge_work += core->num_users * core->num_pages;
+  return 1;
+}
+
+void free_group_core(struct group_core *core) {
+  free(core->userids);
+  free(core->pages);
+}
+
+/* The sources merged into a group's page vector: the core's vector,
+   which the group contains, and the pages of its other members, or
+   every member's pages if core is NULL. Returns the number of
+   sources. */
+int group_sources(const struct user_group *group,
+                  const struct group_core *core,
+                  struct thread_info *tinfo,
+                  struct feature_source *sources) {
+  int num_sources = 0;
+  int64_t *members = group->userids;
+  int num_members = group->num_users;
+  int core_position = 0;
+  if (core != NULL) {
+    sources[num_sources].features = core->pages;
+    sources[num_sources++].count = core->num_pages;
+    members = arena_alloc(tinfo->arena, num_members * sizeof(int64_t));
+    memcpy(members, group->userids, num_members * sizeof(int64_t));
+    qsort(members, num_members, sizeof(int64_t), compare_userids);
+  }
+  for (int i = 0; i < num_members; ++i) {
+    struct feature_source member;
+    user_source(&member, members[i], tinfo);
+    // Both lists are sorted, so members of the core are skipped in
+    // step with it.
+    if (core != NULL && core_position < core->num_users
+        && core->userids[core_position] == members[i]) {
+      ++core_position;
+      continue;
     }
-    if (second_feature_value > 0.0) {
-      second_entropy += second_feature_value * log2(second_feature_value);
+    sources[num_sources++] = member;
+  }
+  assert(core == NULL || core_position == core->num_users);
+  return num_sources;
+}
+
+/* Write the group's userids, space separated. */
+void print_label(FILE *fp, const struct user_group *group) {
+  for (int i = 0; i < group->num_users; ++i) {
+    fprintf(fp, i == 0 ? "%" PRId64 : " %" PRId64, group->userids[i]);
+  }
+}
+
+void output_file_names(char names[][FILE_NAME_SIZE], const char *prefix,
+                       int thread, int num_outputs) {
+  static const char *formats[MAX_OUTPUTS] = {
+    "%sscores_out_%d",
+    "%sraw_page_stats_out_%d",
+    "%sjsd_scores_out_%d",
+    "%sjsd_raw_page_stats_out_%d"
+  };
+  for (int i = 0; i < num_outputs; ++i) {
+    snprintf(names[i], FILE_NAME_SIZE, formats[i], prefix, thread);
+  }
+}
+
+/* Write the scores of a graph whose node accumulators are filled in:
+   the page-level line to page_stats_out, unless it is NULL, and the
+   group-level line to cc_out, once for the group and once for each of
+   its duplicates. If aggregates is not NULL, the pages' scores are
+   added to it for each of them. Returns the CC score. */
+double write_scores(struct dense_graph graph, const struct user_group *group,
+                    FILE *cc_out, FILE *page_stats_out,
+                    struct page_aggregate *aggregates, int64_t num_pages) {
+  double cc = 0.0;
+  for (const struct user_group *g = group; g != NULL; g = g->duplicates) {
+    if (page_stats_out != NULL) {
+      print_label(page_stats_out, g);
+      fprintf(page_stats_out, " %d", graph.num_nodes);
     }
-    if (first_feature_value > 0.0 || second_feature_value > 0.0) {
-      double combined_value = (first_feature_value
-                               + second_feature_value) / 2.0;
-      combined_entropy += combined_value * log2(combined_value);
+    double clust;
+    double cont;
+    cc = finish_coeff(graph, page_stats_out, &cont, &clust);
+    print_label(cc_out, g);
+    fprintf(cc_out, " %1.6e %1.6e %1.6e\n", cc, cont, clust);
+    if (aggregates != NULL) {
+      accumulate_page_stats(aggregates, num_pages, graph);
     }
   }
-  // We take the -1 from entropy into account here
-  return 1.0 - ((first_entropy + second_entropy) / 2.0 - combined_entropy);
+  if (page_stats_out != NULL) {
+    fflush(page_stats_out);
+  }
+  fflush(cc_out);
+  return cc;
 }
-  
-double cosine_similarity(
-    const char *pages_mfile,
-    const struct mmap_item *first_page,
-    const struct mmap_item *second_page) {
-  const struct mmap_feature *first_features = get_features(
-      pages_mfile, first_page);
-  const struct mmap_feature *second_features = get_features(
-      pages_mfile, second_page);
-  if (first_features == NULL || second_features == NULL) {
-    return 0.0;
-  }
-  int first_i = 0;
-  int second_i = 0;
-  double inner_product = 0.0;
-  while (first_i < first_page->count_features
-         && second_i < second_page->count_features) {
-    int first_feature_num = first_features[first_i].feature_number;
-    int second_feature_num = second_features[second_i].feature_number;
-    if (first_feature_num == second_feature_num) {
-      inner_product += first_features[first_i].feature_value
-          * second_features[second_i].feature_value;
-      ++first_i;
-      ++second_i;
-    } else if (first_feature_num < second_feature_num) {
-      ++first_i;
-    } else {
-      ++second_i;
-    }
+
+/* Blocks pinned in the page cache for the item being scored. Pages
+   arrive in page order, so consecutive pages usually share a block,
+   which is pinned once. */
+struct pinned_blocks {
+  int64_t *blocks;
+  int count;
+  /* Decompressed features of the last pinned block. */
+  const struct mmap_feature *last_features;
+};
+
+const struct mmap_feature *cached_page_features(struct block_cache *cache,
+                                                const struct mmap_item *page,
+                                                struct pinned_blocks *pinned) {
+  if (page->features_offset == 0) {
+    return NULL;
   }
-  return div_ignore_zero(
-      inner_product,
-      first_page->sum_or_norm * second_page->sum_or_norm);
+  int64_t block = page_block(page);
+  if (pinned->count > 0 && pinned->blocks[pinned->count - 1] == block) {
+    return pinned->last_features + page_block_position(page);
+  }
+  const struct mmap_feature *features = pin_page_features(cache, page);
+  pinned->blocks[pinned->count++] = block;
+  pinned->last_features = features - page_block_position(page);
+  return features;
 }
 
-void print_cc(const struct mmap_item *user,
-              const struct mmap_feature *user_pages,
-              const char *user_list,
-              FILE *fp_cc_out,
-              FILE *fp_c_out,
-              struct thread_info *tinfo) {
-  struct dense_graph graph = make_graph(user->count_features);
-  for (int i = 0; i < user->count_features; ++i) {
+double node_clustering(const struct node_info *node) {
+  return node->denominator == 0.0 ? 0.0 : node->numerator / node->denominator;
+}
+
+/* Add the differences between a graph scored from reduced-precision
+   edges and the same graph scored at full precision to the thread's
+   deviation statistics. */
+void record_deviation(struct thread_info *tinfo, struct dense_graph reduced,
+                      struct dense_graph full) {
+  double reduced_cont, reduced_clust, full_cont, full_clust;
+  double reduced_cc = finish_coeff(reduced, NULL, &reduced_cont,
+                                   &reduced_clust);
+  double full_cc = finish_coeff(full, NULL, &full_cont, &full_clust);
+  struct precision_deviation *deviation = &tinfo->deviation;
+  double cc_deviation = fabs(reduced_cc - full_cc);
+  double clust_deviation = fabs(reduced_clust - full_clust);
+  ++deviation->num_items;
+  deviation->cc_sum += cc_deviation;
+  deviation->cc_max = fmax(deviation->cc_max, cc_deviation);
+  deviation->clustering_sum += clust_deviation;
+  deviation->clustering_max = fmax(deviation->clustering_max,
+                                   clust_deviation);
+  for (int i = 0; i < reduced.num_nodes; ++i) {
+    double page_deviation = fabs(node_clustering(reduced.nodes + i)
+                                 - node_clustering(full.nodes + i));
+    ++deviation->num_pages;
+    deviation->page_clustering_sum += page_deviation;
+    deviation->page_clustering_max = fmax(deviation->page_clustering_max,
+                                          page_deviation);
+  }
+}
+
+/* Score one item, returning the CC score of the primary metric. */
+double print_cc(const struct mmap_item *user,
+                const struct mmap_feature *user_pages,
+                const struct user_group *group,
+                FILE **outputs,
+                struct thread_info *tinfo,
+                struct sim_cache *cache) {
+  int n = (int)user->count_features;
+  struct arena *arena = tinfo->arena;
+  int fused = tinfo->use_fused && !tinfo->multi_metric;
+  struct dense_graph graph = make_arena_graph(arena, n, !fused);
+  struct page_vector *page_vectors = arena_alloc(
+      arena, n * sizeof(struct page_vector));
+  int needs_sum = tinfo->multi_metric || metric_needs_sum(tinfo->metric);
+  int *cache_index = NULL;
+  if (cache != NULL) {
+    cache_index = arena_alloc(arena, n * sizeof(int));
+  }
+  struct pinned_blocks pinned;
+  pinned.blocks = NULL;
+  pinned.count = 0;
+  pinned.last_features = NULL;
+  if (tinfo->page_cache != NULL) {
+    pinned.blocks = arena_alloc(arena, n * sizeof(int64_t));
+  }
+  for (int i = 0; i < n; ++i) {
     int64_t page_num = user_pages[i].feature_number;
     assert(page_num < tinfo->num_pages);
     assert(page_num < tinfo->num_controversy);
@@ -205,89 +349,410 @@ void print_cc(const struct mmap_item *user,
              div_ignore_zero(user_pages[i].feature_value,
                              user->sum_or_norm),
              page_num);
-    for (int j = i + 1; j < user->count_features; ++j) {
-      double similarity = SIM_FUNC(
-          tinfo->mmap_pages,
-          tinfo->pages + page_num,
-          tinfo->pages + user_pages[j].feature_number);
-      set_edge(graph, i, j, similarity);
+    const struct mmap_item *page = tinfo->pages + page_num;
+    if (tinfo->page_cache != NULL) {
+      resolve_page_features(
+          page_vectors + i,
+          cached_page_features(tinfo->page_cache, page, &pinned),
+          page, needs_sum);
+    } else {
+      resolve_page_vector(page_vectors + i, tinfo->mmap_pages, page,
+                          needs_sum);
+    }
+    if (cache != NULL) {
+      cache_index[i] = sim_cache_index(cache, page_num);
+    }
+  }
+  tinfo->pair_count += (int64_t)n * (n - 1) / 2;
+  double cc;
+  if (tinfo->multi_metric) {
+    // Cosine and JSD graphs from one walk over each page pair, then one
+    // pass over the triangles of both.
+    struct dense_graph jsd_graph = make_arena_graph(arena, n, 1);
+    memcpy(jsd_graph.nodes, graph.nodes, n * sizeof(struct node_info));
+    tinfo->sim_evaluations += build_edges_cosine_jsd(graph, jsd_graph,
+                                                     page_vectors);
+    accumulate_coeff_pair(graph, jsd_graph);
+    cc = write_scores(graph, group, outputs[CC_OUTPUT],
+                      outputs[PAGE_STATS_OUTPUT], tinfo->page_aggregates,
+                      tinfo->num_controversy);
+    write_scores(jsd_graph, group, outputs[JSD_CC_OUTPUT],
+                 outputs[JSD_PAGE_STATS_OUTPUT], NULL, 0);
+  } else if (fused) {
+    // Build the packed upper triangle a row at a time from the last row
+    // up, folding each row into the triangle sums while it is still in
+    // cache. At reduced precision each row is built in double and
+    // stored narrowed; with compare_precision the full-precision rows
+    // are kept too and scored alongside.
+    row_builder_fn build_row = row_builder(tinfo->metric);
+    enum edge_precision precision = tinfo->precision;
+    int compare = tinfo->compare_precision && precision != PRECISION_DOUBLE;
+    double *packed = NULL;
+    double *row = NULL;
+    char *narrow = NULL;
+    size_t bytes = edge_bytes(precision);
+    if (precision == PRECISION_DOUBLE || compare) {
+      packed = arena_alloc(arena, packed_size(n) * sizeof(double));
+    } else {
+      row = arena_alloc(arena, n * sizeof(double));
+    }
+    if (precision != PRECISION_DOUBLE) {
+      narrow = arena_alloc(arena, packed_size(n) * bytes);
+    }
+    struct dense_graph full_graph;
+    if (compare) {
+      full_graph = make_arena_graph(arena, n, 0);
+      memcpy(full_graph.nodes, graph.nodes, n * sizeof(struct node_info));
+    }
+    for (int i = n - 1; i >= 0; --i) {
+      size_t offset = packed_row_offset(n, i);
+      double *row_i = packed != NULL ? packed + offset : row;
+      build_row(page_vectors, n, i, row_i);
+      if (precision == PRECISION_DOUBLE) {
+        accumulate_coeff_row(graph, packed, i);
+        continue;
+      }
+      pack_edges(precision, row_i, n - i - 1, narrow + offset * bytes);
+      accumulate_coeff_row_precision(graph, narrow, i, precision);
+      if (compare) {
+        accumulate_coeff_row(full_graph, packed, i);
+      }
+    }
+    tinfo->sim_evaluations += packed_size(n);
+    ++tinfo->num_fused;
+    cc = write_scores(graph, group, outputs[CC_OUTPUT],
+                      outputs[PAGE_STATS_OUTPUT], tinfo->page_aggregates,
+                      tinfo->num_controversy);
+    if (compare) {
+      record_deviation(tinfo, graph, full_graph);
+    }
+  } else {
+    // The metric is dispatched once here; the per-pair loop is
+    // specialized for it.
+    tinfo->sim_evaluations += edge_builder(tinfo->metric)(
+        graph, page_vectors, cache, cache_index);
+    accumulate_coeff(graph);
+    cc = write_scores(graph, group, outputs[CC_OUTPUT],
+                      outputs[PAGE_STATS_OUTPUT], tinfo->page_aggregates,
+                      tinfo->num_controversy);
+  }
+  for (int i = 0; i < pinned.count; ++i) {
+    unpin_block(tinfo->page_cache, pinned.blocks[i]);
+  }
+  return cc;
+}
+
+/* Score a single work item, writing its results to the output
+   files. cache may be NULL, or hold the similarities of the batch the
+   item belongs to, and core may be NULL, or hold the merged pages of
+   its chain's core. Returns 0 if the item was skipped, otherwise sets
+   cc to its CC score and returns 1. */
+int score_work_item(struct user_group *work, struct thread_info *tinfo,
+                    FILE **outputs, struct sim_cache *cache,
+                    const struct group_core *core, double *cc) {
+  if (work->pages != NULL) {
+    if (work->num_pages == 0 || work->num_pages > MAX_USER_PAGES) {
+      return 0;
+    }
+    struct mmap_item user;
+    user.id = work->userids[0];
+    user.count_features = work->num_pages;
+    user.features_offset = 0;
+    user.sum_or_norm = 0.0;
+    for (int64_t i = 0; i < work->num_pages; ++i) {
+      user.sum_or_norm += work->pages[i].feature_value;
+    }
+    *cc = print_cc(&user, work->pages, work, outputs, tinfo, cache);
+  } else if (work->num_users == 1) {
+    int64_t userid = work->userids[0];
+    assert(userid < tinfo->num_users);
+    const struct mmap_item *user = tinfo->users + userid;
+    const struct mmap_feature *user_pages = get_features(
+        tinfo->mmap_users, user);
+    if (user_pages == NULL || user->count_features > MAX_USER_PAGES) {
+      return 0;
+    }
+    *cc = print_cc(user, user_pages, work, outputs, tinfo, cache);
+  } else {
+    struct mmap_item group_info;
+    struct feature_source *sources = arena_alloc(
+        tinfo->arena, (work->num_users + 1) * sizeof(struct feature_source));
+    int num_sources = group_sources(work, core, tinfo, sources);
+    group_info.id = -1;
+    group_info.features_offset = 0;
+    struct mmap_feature *group_pages = merge_sources(
+        sources, num_sources, tinfo->arena, tinfo->arena,
+        &group_info.count_features, &group_info.sum_or_norm);
+    tinfo->merge_work += num_sources * group_info.count_features;
+    tinfo->merge_work_unshared += work->num_users * group_info.count_features;
+    *cc = print_cc(&group_info, group_pages, work, outputs, tinfo, cache);
+  }
+  return 1;
+}
+
+/* Free the duplicates attached to work. */
+void free_duplicates(struct user_group *work) {
+  struct user_group *d = work->duplicates;
+  while (d != NULL) {
+    struct user_group *next = d->duplicates;
+    free(d->userids);
+    free(d);
+    d = next;
+  }
+  work->duplicates = NULL;
+}
+
+/* Number of pages in work, or for groups the sum of the members' page
+   counts, which bounds the size of their union. 0 if the item will be
+   skipped. */
+int64_t item_pages(const struct user_group *work,
+                   const struct thread_info *tinfo) {
+  int64_t n = 0;
+  if (work->pages != NULL) {
+    n = work->num_pages;
+  } else {
+    for (int i = 0; i < work->num_users; ++i) {
+      if (work->userids[i] < tinfo->num_users) {
+        n += tinfo->users[work->userids[i]].count_features;
+      }
+    }
+  }
+  if (work->num_users == 1 && n > MAX_USER_PAGES) {
+    return 0;
+  }
+  return n;
+}
+
+/* Estimated peak memory used while scoring an item with n pages: the
+   edges of each metric scored, dense or packed at the edge precision,
+   and the per-page arrays. */
+int64_t scoring_footprint(int64_t n, int fused,
+                          const struct thread_info *tinfo) {
+  int64_t num_graphs = tinfo->multi_metric ? 2 : 1;
+  int64_t edge_size = n * n * (int64_t)sizeof(double);
+  if (fused) {
+    int64_t num_edges = n * (n - 1) / 2;
+    edge_size = num_edges * (int64_t)edge_bytes(tinfo->precision)
+        + n * (int64_t)sizeof(double);
+    if (tinfo->compare_precision
+        && tinfo->precision != PRECISION_DOUBLE) {
+      edge_size += num_edges * (int64_t)sizeof(double)
+          + n * (int64_t)sizeof(struct node_info);
+    }
+  }
+  int64_t graph_bytes = edge_size + n * (int64_t)sizeof(struct node_info);
+  int64_t page_bytes = n * (int64_t)(sizeof(struct page_vector) + sizeof(int)
+                                     + sizeof(struct mmap_feature));
+  return num_graphs * graph_bytes + page_bytes;
+}
+
+/* The fused engine is used when requested, and as the lower-memory path
+   for items whose dense graph would not fit in the memory budget. It
+   scores one metric at a time. */
+int use_fused_engine(const struct thread_info *tinfo, int64_t n) {
+  if (tinfo->multi_metric) {
+    return 0;
+  }
+  if (tinfo->fused) {
+    return 1;
+  }
+  return tinfo->budget != NULL
+      && scoring_footprint(n, 0, tinfo) > tinfo->budget->budget;
+}
+
+/* Estimated memory held for a popped item, which is a chain of items
+   when batching: the largest footprint of its items, which are scored
+   one after the other, plus for a chain the shared similarity cache
+   and the merged core of its groups, bounded by the chain's total page
+   count. */
+int64_t chain_footprint(const struct user_group *chain,
+                        const struct thread_info *tinfo) {
+  int64_t largest = 0;
+  int64_t total = 0;
+  for (const struct user_group *g = chain; g != NULL; g = g->next) {
+    int64_t n = item_pages(g, tinfo);
+    int64_t footprint = scoring_footprint(n, use_fused_engine(tinfo, n),
+                                          tinfo);
+    if (footprint > largest) {
+      largest = footprint;
+    }
+    for (int i = 0; i < g->num_users; ++i) {
+      if (g->userids[i] < tinfo->num_users) {
+        total += tinfo->users[g->userids[i]].count_features;
+      }
     }
   }
-  fprintf(fp_c_out, "%s %" PRId64, user_list, user->count_features);
-  double clust;
-  double cont;
-  double cc = coeff(graph, fp_c_out, &cont, &clust);
-  fprintf(fp_cc_out, "%s %1.6e %1.6e %1.6e\n",
-          user_list, cc, cont, clust);
-  fflush(fp_c_out);
-  fflush(fp_cc_out);
-  free_graph(graph);
+  if (chain->next == NULL) {
+    return largest;
+  }
+  int64_t shared = total < MAX_SHARED_SIM_PAGES
+      ? total : MAX_SHARED_SIM_PAGES;
+  int64_t cache_bytes = total * (int64_t)sizeof(int64_t)
+      + shared * shared * (int64_t)sizeof(double);
+  int64_t core_bytes = 0;
+  if (chain->num_users > 1) {
+    // The core is a subset of the first group's members.
+    core_bytes = item_pages(chain, tinfo)
+        * (int64_t)sizeof(struct mmap_feature);
+  }
+  return largest + cache_bytes + core_bytes;
+}
+
+/* Score an item into memory and offer its output lines to the shared
+   top-N results. */
+void score_top_item(struct user_group *work, struct thread_info *tinfo) {
+  char *lines[JSD_CC_OUTPUT] = {NULL, NULL};
+  size_t sizes[JSD_CC_OUTPUT];
+  FILE *outputs[JSD_CC_OUTPUT];
+  for (int i = 0; i < JSD_CC_OUTPUT; ++i) {
+    outputs[i] = open_memstream(&lines[i], &sizes[i]);
+    assert(outputs[i]);
+  }
+  double cc;
+  int scored = score_work_item(work, tinfo, outputs, NULL, NULL, &cc);
+  for (int i = 0; i < JSD_CC_OUTPUT; ++i) {
+    fclose(outputs[i]);
+  }
+  if (scored) {
+    offer_top_result(tinfo->top, cc, work->sequence,
+                     lines[CC_OUTPUT], lines[PAGE_STATS_OUTPUT]);
+  } else {
+    free(lines[CC_OUTPUT]);
+    free(lines[PAGE_STATS_OUTPUT]);
+  }
 }
 
 void* generate_scores(void *thread_info) {
   struct thread_info *tinfo = thread_info;
-  FILE *fp_cc_out = fopen(tinfo->cc_output_file, "w");
-  assert(fp_cc_out);
-  FILE *fp_c_out = fopen(tinfo->c_output_file, "w");
-  assert(fp_c_out);
+  const char *mode = tinfo->resume ? "a" : "w";
+  FILE *outputs[MAX_OUTPUTS];
+  // Top-N results are kept in memory and written by the caller.
+  int num_outputs = tinfo->top != NULL ? 0 : tinfo->num_outputs;
+  for (int i = 0; i < num_outputs; ++i) {
+    if (tinfo->no_raw_page_stats
+        && (i == PAGE_STATS_OUTPUT || i == JSD_PAGE_STATS_OUTPUT)) {
+      outputs[i] = NULL;
+      continue;
+    }
+    outputs[i] = fopen(tinfo->output_files[i], mode);
+    assert(outputs[i]);
+    // Checkpoints record output offsets, which must be absolute.
+    fseek(outputs[i], 0, SEEK_END);
+  }
+  // Allocated here so the pages touched first are local to the thread.
+  tinfo->page_aggregates = NULL;
+  if (tinfo->aggregate_pages) {
+    tinfo->page_aggregates = calloc(tinfo->num_controversy,
+                                    sizeof(struct page_aggregate));
+  }
+  struct checkpoint_writer checkpoint;
+  int checkpointing = tinfo->checkpoint_file[0] != '\0';
+  if (checkpointing) {
+    init_checkpoint(&checkpoint, tinfo->checkpoint_file,
+                    tinfo->checkpoint_interval, tinfo->resume,
+                    outputs, tinfo->num_outputs);
+  }
+  tinfo->pair_count = 0;
+  tinfo->sim_evaluations = 0;
+  tinfo->num_latencies = 0;
+  tinfo->num_fused = 0;
+  tinfo->num_pruned = 0;
+  memset(&tinfo->deviation, 0, sizeof(tinfo->deviation));
+  tinfo->merge_work = 0;
+  tinfo->merge_work_unshared = 0;
+  tinfo->latency_sum = 0.0;
+  tinfo->latency_max = 0.0;
+  struct arena arena;
+  init_arena(&arena);
+  tinfo->arena = &arena;
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  int64_t start_faults = usage.ru_majflt;
   
   struct user_group *work;
-  char user_buffer[USER_BUFFER_SIZE];
   while ((work = pop_front(tinfo->input_queue)) != NULL) {
-    if (work->num_users == 1) {
-      int64_t userid = work->userids[0];
-      assert(userid < tinfo->num_users);
-      const struct mmap_item *user = tinfo->users + userid;
-      const struct mmap_feature *user_pages = get_features(
-          tinfo->mmap_users, user);
-      if (user_pages == NULL || user->count_features > 50000) {
-        continue;
+    if (tinfo->top != NULL && !top_can_enter(tinfo->top, work->cc_bound)) {
+      ++tinfo->num_pruned;
+      free(work->userids);
+      free(work);
+      continue;
+    }
+    struct sim_cache cache;
+    struct sim_cache *batch_cache = NULL;
+    struct group_core core;
+    struct group_core *chain_core = NULL;
+    // Reserved once for the whole chain, so that a worker never waits
+    // for memory while holding some.
+    int64_t reserved = 0;
+    if (tinfo->budget != NULL) {
+      reserved = reserve_memory(tinfo->budget,
+                                chain_footprint(work, tinfo));
+    }
+    if (work->next != NULL) {
+      if (init_sim_cache(&cache, work, tinfo->mmap_users, tinfo->users,
+                         MAX_SHARED_SIM_PAGES)) {
+        batch_cache = &cache;
       }
-      snprintf(user_buffer, USER_BUFFER_SIZE, "%" PRId64, userid);
-      print_cc(user, user_pages, user_buffer, fp_cc_out, fp_c_out, tinfo);
-    } else {
-      struct mmap_item group_info;
-      struct feature_iterator it;
-      init_feature_iterator(&it, work, tinfo);
-      group_info.count_features = 0;
-      group_info.sum_or_norm = 0.0;
-      while (next_feature(&it)) {
-        ++group_info.count_features;
-        group_info.sum_or_norm += it.feature_value;
+      if (work->num_users > 1 && init_group_core(&core, work, tinfo)) {
+        chain_core = &core;
       }
-      free_feature_iterator(&it);
-      group_info.id = -1;
-      struct mmap_feature *group_pages = malloc(
-          sizeof(struct mmap_feature) * group_info.count_features);
-      init_feature_iterator(&it, work, tinfo);
-      int64_t i = 0;
-      while (next_feature(&it)) {
-        assert (i < group_info.count_features);
-        group_pages[i].feature_number = it.feature_id;
-        group_pages[i].feature_value = it.feature_value;
-        ++i;
+    }
+    while (work != NULL) {
+      double cc;
+      int64_t n = item_pages(work, tinfo);
+      tinfo->use_fused = use_fused_engine(tinfo, n);
+      if (tinfo->top != NULL) {
+        score_top_item(work, tinfo);
+      } else {
+        score_work_item(work, tinfo, outputs, batch_cache, chain_core,
+                        &cc);
       }
-      assert (i == group_info.count_features);
-      free_feature_iterator(&it);
-      char *user_buffer_pos = user_buffer;
-      for (i = 0; i < work->num_users; ++i) {
-        user_buffer_pos += snprintf(
-            user_buffer_pos,
-            USER_BUFFER_SIZE - (user_buffer_pos - user_buffer),
-            "%" PRId64 " ", work->userids[i]);
-        
+      reset_arena(&arena);
+      if (checkpointing) {
+        checkpoint_item_done(&checkpoint, work->sequence);
+        for (struct user_group *d = work->duplicates; d != NULL;
+             d = d->duplicates) {
+          checkpoint_item_done(&checkpoint, d->sequence);
+        }
       }
-      if (user_buffer_pos > user_buffer) {
-        *(user_buffer_pos - 1) = '\0';
+      if (work->event_time > 0.0) {
+        double latency = monotonic_seconds() - work->event_time;
+        ++tinfo->num_latencies;
+        tinfo->latency_sum += latency;
+        if (latency > tinfo->latency_max) {
+          tinfo->latency_max = latency;
+        }
       }
-      print_cc(&group_info, group_pages, user_buffer,
-               fp_cc_out, fp_c_out, tinfo);
-      free(group_pages);
+      struct user_group *next = work->next;
+      free_duplicates(work);
+      free(work->pages);
+      free(work->userids);
+      free(work);
+      work = next;
+    }
+    if (batch_cache != NULL) {
+      free_sim_cache(batch_cache);
+    }
+    if (chain_core != NULL) {
+      free_group_core(chain_core);
+    }
+    if (tinfo->budget != NULL) {
+      release_memory(tinfo->budget, reserved);
+    }
+  }
+  if (checkpointing) {
+    close_checkpoint(&checkpoint);
+  }
+  for (int i = 0; i < num_outputs; ++i) {
+    if (outputs[i] != NULL) {
+      fclose(outputs[i]);
     }
-    free(work->userids);
-    free(work);
   }
-  fclose(fp_c_out);
-  fclose(fp_cc_out);
+  getrusage(RUSAGE_THREAD, &usage);
+  tinfo->major_faults = usage.ru_majflt - start_faults;
+  tinfo->arena_chunks = arena.num_chunks_allocated;
+  tinfo->arena_peak = arena.peak;
+  tinfo->arena = NULL;
+  free_arena(&arena);
   return NULL;
 }
@@ -9,15 +9,70 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "metrics.h"
+
 struct queue;
+struct top_results;
+struct memory_budget;
+struct arena;
+struct block_cache;
+struct page_aggregate;
 struct mmap_item;
 struct mmap_feature;
 
+/* Users with more pages than this are skipped. */
+#define MAX_USER_PAGES 50000
+
+#define FILE_NAME_SIZE 1024
+
+/* Indices of a thread's output files. The JSD files are only written
+   when scoring cosine and JSD together. */
+enum output_file {
+  CC_OUTPUT,
+  PAGE_STATS_OUTPUT,
+  JSD_CC_OUTPUT,
+  JSD_PAGE_STATS_OUTPUT,
+  MAX_OUTPUTS
+};
+
+/* Differences between scores from reduced-precision edges and the
+   same scores at full precision, over the items compared. */
+struct precision_deviation {
+  int64_t num_items;
+  double cc_max;
+  double cc_sum;
+  double clustering_max;
+  double clustering_sum;
+  /* Per-page clustering. */
+  int64_t num_pages;
+  double page_clustering_max;
+  double page_clustering_sum;
+};
+
 struct user_group {
   int num_users;
   int64_t *userids;
+  /* Position of this item in the input, used for checkpointing. */
+  int64_t sequence;
+  /* Next member of a page-locality batch (see batch.h), or NULL. */
+  struct user_group *next;
+  /* Items with the same normalized page vector, whose scores are
+     copies of this item's (see dedup.h), linked through their own
+     duplicates fields. */
+  struct user_group *duplicates;
+  /* If not NULL, a single user's pages to score in place of its pages
+     in users_mmap (see stream.h). */
+  struct mmap_feature *pages;
+  int64_t num_pages;
+  /* Arrival of the oldest event this item accounts for, or 0. */
+  double event_time;
+  /* In top-N mode, the item's CC upper bound (see top.h). */
+  double cc_bound;
 };
 
+/* Hands a work item on towards the workers. */
+typedef void (*emit_work_fn)(struct user_group *work, void *context);
+
 struct thread_info {
   const char *mmap_pages;
   const struct mmap_item *pages;
@@ -28,20 +83,77 @@ struct thread_info {
   const struct mmap_feature *controversy;
   int num_controversy;
   struct queue *input_queue;
-  char cc_output_file[100];
-  char c_output_file[100];
+  char output_files[MAX_OUTPUTS][FILE_NAME_SIZE];
+  int num_outputs;
+  /* Empty if checkpointing is disabled. */
+  char checkpoint_file[FILE_NAME_SIZE];
+  double checkpoint_interval;
+  /* Page similarity metric used for graph edges. */
+  enum metric metric;
+  /* Score cosine and JSD together instead of metric. */
+  int multi_metric;
+  /* Score every item with the fused packed-triangle engine instead of
+     building its dense graph. */
+  int fused;
+  /* Whether the item being scored uses the fused engine. */
+  int use_fused;
+  /* Storage of the fused engine's packed edges; anything but double
+     implies fused. */
+  enum edge_precision precision;
+  /* Also score reduced-precision items at full precision and record
+     the differences in deviation. */
+  int compare_precision;
+  struct precision_deviation deviation;
+  /* If not NULL, offer results to these shared top-N results instead
+     of writing them to the output files. */
+  struct top_results *top;
+  /* If not NULL, reserve each item's estimated memory from this shared
+     budget before scoring it. */
+  struct memory_budget *budget;
+  /* If not NULL, pages is a block store (see block_store.h) whose
+     features are read through this shared cache. */
+  struct block_cache *page_cache;
+  /* Skip the raw page stats outputs. */
+  int no_raw_page_stats;
+  /* Accumulate per-page aggregates of the primary metric's scores. The
+     thread allocates page_aggregates, with num_controversy entries, and
+     the caller frees it. */
+  int aggregate_pages;
+  struct page_aggregate *page_aggregates;
+  /* Scratch memory for the item being scored, reset between items. */
+  struct arena *arena;
+  /* Append to existing outputs rather than truncating them. */
+  int resume;
+  /* Statistics written by the thread: page pairs in the graphs built,
+     and similarities actually evaluated for them. */
+  int64_t pair_count;
+  int64_t sim_evaluations;
+  /* Work merging group members' page vectors, counted as the merged
+     lists' lengths times the number of lists they were merged from,
+     and that work without shared chain cores. */
+  int64_t merge_work;
+  int64_t merge_work_unshared;
+  /* Items scored with the fused engine. */
+  int64_t num_fused;
+  /* Top-N items skipped because their bound fell below the results'
+     threshold while they were queued. */
+  int64_t num_pruned;
+  /* Event-to-score latency of streamed items, in seconds. */
+  int64_t num_latencies;
+  double latency_sum;
+  double latency_max;
+  /* Scratch memory requested from the system, and the most any item
+     used. */
+  int64_t arena_chunks;
+  size_t arena_peak;
+  /* Major page faults taken by the thread while scoring. */
+  int64_t major_faults;
 };
 
-/* Determines which type of similarity function to use:
-   cosine similarity or Jensen-Shannon divergence */
-#define SIM_FUNC cosine_similarity
-
-double JSD(const char *pages_mfile,
-           const struct mmap_item *first_page,
-           const struct mmap_item *second_page);
-double cosine_similarity(const char *pages_mfile,
-                         const struct mmap_item *first_page,
-                         const struct mmap_item *second_page);
+/* Fill names with the first num_outputs output file names of the given
+   thread. */
+void output_file_names(char names[][FILE_NAME_SIZE], const char *prefix,
+                       int thread, int num_outputs);
 
 /* Compute CC, controversy, and clustering scores for the items drawn
    from thread_info->input_queue, writing them to the files specified
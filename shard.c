@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "shard.h"
+#include "read_mmap.h"
+#include "score_thread.h"
+
+int parse_shard(const char *arg, struct shard_spec *spec) {
+  int index, count;
+  char trailing;
+  if (sscanf(arg, "%d/%d%c", &index, &count, &trailing) != 2) {
+    return 0;
+  }
+  if (count < 1 || index < 0 || index >= count) {
+    return 0;
+  }
+  spec->index = index;
+  spec->count = count;
+  spec->by_hash = 0;
+  spec->first_userid = 0;
+  spec->end_userid = INT64_MAX;
+  spec->cost_share = 1.0 / count;
+  return 1;
+}
+
+double estimated_cost(int64_t count_features) {
+  if (count_features > MAX_USER_PAGES) {
+    // Skipped by generate_scores
+    return 1.0;
+  }
+  double n = (double)count_features;
+  // The constant accounts for per-item overhead of tiny users.
+  return n * n * n + 1.0;
+}
+
+void init_shard_ranges(struct shard_spec *spec,
+                       const struct mmap_item *users, int64_t num_users) {
+  if (spec->by_hash) {
+    return;
+  }
+  double total_cost = 0.0;
+  for (int64_t i = 0; i < num_users; ++i) {
+    total_cost += estimated_cost(users[i].count_features);
+  }
+  double begin_cost = total_cost * spec->index / spec->count;
+  double end_cost = total_cost * (spec->index + 1) / spec->count;
+  double prefix_cost = 0.0;
+  spec->first_userid = num_users;
+  spec->end_userid = num_users;
+  for (int64_t i = 0; i < num_users; ++i) {
+    if (spec->first_userid == num_users && prefix_cost >= begin_cost) {
+      spec->first_userid = i;
+    }
+    if (prefix_cost >= end_cost) {
+      spec->end_userid = i;
+      break;
+    }
+    prefix_cost += estimated_cost(users[i].count_features);
+  }
+  if (spec->index == spec->count - 1) {
+    // Anything past the end of users_mmap fails later with a useful
+    // assertion rather than being silently dropped.
+    spec->end_userid = INT64_MAX;
+  }
+  double owned_cost = 0.0;
+  for (int64_t i = spec->first_userid;
+       i < spec->end_userid && i < num_users; ++i) {
+    owned_cost += estimated_cost(users[i].count_features);
+  }
+  spec->cost_share = total_cost > 0.0 ? owned_cost / total_cost : 0.0;
+}
+
+static uint64_t mix64(uint64_t x) {
+  // splitmix64 finalizer
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+int shard_owns_group(const struct shard_spec *spec,
+                     const int64_t *userids, int num_users) {
+  assert(num_users > 0);
+  if (spec->count == 1) {
+    return 1;
+  }
+  if (!spec->by_hash && num_users == 1) {
+    return userids[0] >= spec->first_userid
+        && userids[0] < spec->end_userid;
+  }
+  uint64_t hash = 0;
+  for (int i = 0; i < num_users; ++i) {
+    hash = mix64(hash ^ (uint64_t)userids[i]);
+  }
+  return (int)(hash % (uint64_t)spec->count) == spec->index;
+}
@@ -0,0 +1,41 @@
+/* Deterministic assignment of work items to one of several cc_mmap
+   processes. Single users are assigned by contiguous userid ranges
+   whose estimated scoring cost (cubic in the number of pages) is
+   balanced across shards; alternatively every item can be assigned by
+   a hash of its userids. Groups are always assigned by hash. */
+
+#ifndef __shard_h__
+#define __shard_h__
+
+#include <stdint.h>
+
+struct mmap_item;
+
+struct shard_spec {
+  int index;
+  int count;
+  int by_hash;
+  /* Users in [first_userid, end_userid) belong to this shard when not
+     assigning by hash. */
+  int64_t first_userid;
+  int64_t end_userid;
+  /* Fraction of the total estimated cost owned by this shard. */
+  double cost_share;
+};
+
+/* Parse "i/N" into spec. Returns 0 if the string is malformed. */
+int parse_shard(const char *arg, struct shard_spec *spec);
+
+/* Estimated relative cost of scoring an item with count_features
+   pages. */
+double estimated_cost(int64_t count_features);
+
+/* Compute this shard's userid range from the users' page counts. */
+void init_shard_ranges(struct shard_spec *spec,
+                       const struct mmap_item *users, int64_t num_users);
+
+/* Returns 1 if the group of userids belongs to this shard. */
+int shard_owns_group(const struct shard_spec *spec,
+                     const int64_t *userids, int num_users);
+
+#endif
@@ -7,10 +7,15 @@
 
 #include "score_thread.h"
 #include "read_mmap.h"
+#include "metrics.h"
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    printf("Usage: %s page_mmap first_pageid second_pageid\n", argv[0]);
+  enum metric metric = METRIC_COSINE;
+  if ((argc != 4 && argc != 5)
+      || (argc == 5 && !parse_metric(argv[4], &metric))) {
+    printf("Usage: %s page_mmap first_pageid second_pageid [metric]\n"
+           "metric is cosine (default), jsd, jaccard, or"
+           " weighted-overlap\n", argv[0]);
     return 1;
   }
   int page_mmapfd;
@@ -23,7 +28,8 @@ int main(int argc, char **argv) {
   assert(second_pageid < num_pages && second_pageid >= 0);
   assert(pages[first_pageid].id == first_pageid);
   assert(pages[second_pageid].id == second_pageid);
-  printf("%1.4f\n", SIM_FUNC(
+  printf("%1.4f\n", page_similarity(
+      metric,
       page_mmap,
       pages + first_pageid,
       pages + second_pageid));
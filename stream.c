@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "read_mmap.h"
+#include "score_thread.h"
+
+#define STREAM_BUFFER_SIZE (1 << 16)
+#define INITIAL_OVERLAY_CAPACITY 1024
+#define INITIAL_USER_PAGES 16
+
+double monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void init_table(struct stream_state *stream, int64_t capacity) {
+  stream->table_capacity = capacity;
+  stream->table = malloc(capacity * sizeof(struct user_overlay));
+  for (int64_t i = 0; i < capacity; ++i) {
+    stream->table[i].userid = -1;
+  }
+}
+
+void init_stream(struct stream_state *stream, const char *file_name,
+                 const char *mmap_users, const struct mmap_item *users,
+                 int64_t num_users, int64_t num_pages, double half_life) {
+  memset(stream, 0, sizeof(struct stream_state));
+  if (strcmp(file_name, "-") == 0) {
+    stream->fd = STDIN_FILENO;
+  } else {
+    stream->fd = open(file_name, O_RDONLY);
+    if (stream->fd < 0) {
+      fprintf(stderr, "Could not open %s\n", file_name);
+      exit(1);
+    }
+  }
+  stream->mmap_users = mmap_users;
+  stream->users = users;
+  stream->num_users = num_users;
+  stream->num_pages = num_pages;
+  stream->half_life = half_life;
+  stream->start_time = monotonic_seconds();
+  init_table(stream, INITIAL_OVERLAY_CAPACITY);
+  stream->buffer = malloc(STREAM_BUFFER_SIZE);
+}
+
+static int64_t hash_slot(int64_t userid, int64_t capacity) {
+  uint64_t x = (uint64_t)userid * 0x9E3779B97F4A7C15ULL;
+  return (int64_t)((x >> 17) & (uint64_t)(capacity - 1));
+}
+
+static int64_t find_slot(const struct stream_state *stream, int64_t userid) {
+  int64_t slot = hash_slot(userid, stream->table_capacity);
+  while (stream->table[slot].userid != -1
+         && stream->table[slot].userid != userid) {
+    slot = (slot + 1) & (stream->table_capacity - 1);
+  }
+  return slot;
+}
+
+static void grow_table(struct stream_state *stream) {
+  struct user_overlay *old_table = stream->table;
+  int64_t old_capacity = stream->table_capacity;
+  init_table(stream, 2 * old_capacity);
+  for (int64_t i = 0; i < old_capacity; ++i) {
+    if (old_table[i].userid != -1) {
+      stream->table[find_slot(stream, old_table[i].userid)] = old_table[i];
+    }
+  }
+  free(old_table);
+  // Pending entries are slot numbers, which have all moved.
+  int64_t num_pending = 0;
+  for (int64_t i = 0; i < stream->table_capacity; ++i) {
+    if (stream->table[i].userid != -1
+        && stream->table[i].first_pending > 0.0) {
+      stream->pending[num_pending++] = i;
+    }
+  }
+  assert(num_pending == stream->num_pending);
+}
+
+/* The overlay of userid, copied from users_mmap on first use. */
+static struct user_overlay *get_overlay(struct stream_state *stream,
+                                        int64_t userid) {
+  int64_t slot = find_slot(stream, userid);
+  if (stream->table[slot].userid == userid) {
+    return stream->table + slot;
+  }
+  if (2 * (stream->table_size + 1) > stream->table_capacity) {
+    grow_table(stream);
+    slot = find_slot(stream, userid);
+  }
+  struct user_overlay *overlay = stream->table + slot;
+  overlay->userid = userid;
+  overlay->count = 0;
+  const struct mmap_feature *base = NULL;
+  if (userid < stream->num_users) {
+    base = get_features(stream->mmap_users, stream->users + userid);
+  }
+  if (base != NULL) {
+    overlay->count = stream->users[userid].count_features;
+  }
+  overlay->capacity = overlay->count > INITIAL_USER_PAGES
+      ? overlay->count : INITIAL_USER_PAGES;
+  overlay->pages = malloc(overlay->capacity * sizeof(struct mmap_feature));
+  if (overlay->count > 0) {
+    memcpy(overlay->pages, base, overlay->count * sizeof(struct mmap_feature));
+  }
+  overlay->last_update = stream->start_time;
+  overlay->first_pending = 0.0;
+  ++stream->table_size;
+  return overlay;
+}
+
+/* Scale the overlay's weights for the time since its last update, and
+   drop pages that have left the window. */
+static void decay_overlay(struct user_overlay *overlay, double half_life,
+                          double now) {
+  double factor = exp2(-(now - overlay->last_update) / half_life);
+  overlay->last_update = now;
+  double sum = 0.0;
+  for (int64_t i = 0; i < overlay->count; ++i) {
+    overlay->pages[i].feature_value *= factor;
+    sum += overlay->pages[i].feature_value;
+  }
+  int64_t kept = 0;
+  for (int64_t i = 0; i < overlay->count; ++i) {
+    if (overlay->pages[i].feature_value >= STREAM_EXPIRY_FRACTION * sum) {
+      overlay->pages[kept++] = overlay->pages[i];
+    }
+  }
+  overlay->count = kept;
+}
+
+/* Add delta to one page's weight, keeping pages sorted and removing
+   pages whose weight is no longer positive. */
+static void apply_delta(struct user_overlay *overlay, int64_t page_num,
+                        double delta) {
+  int64_t low = 0;
+  int64_t high = overlay->count;
+  while (low < high) {
+    int64_t middle = low + (high - low) / 2;
+    if (overlay->pages[middle].feature_number < page_num) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  struct mmap_feature *pages = overlay->pages;
+  if (low < overlay->count && pages[low].feature_number == page_num) {
+    pages[low].feature_value += delta;
+    if (pages[low].feature_value <= 0.0) {
+      memmove(pages + low, pages + low + 1,
+              (overlay->count - low - 1) * sizeof(struct mmap_feature));
+      --overlay->count;
+    }
+    return;
+  }
+  if (delta <= 0.0) {
+    return;
+  }
+  if (overlay->count == overlay->capacity) {
+    overlay->capacity *= 2;
+    overlay->pages = realloc(overlay->pages,
+                             overlay->capacity * sizeof(struct mmap_feature));
+    pages = overlay->pages;
+  }
+  memmove(pages + low + 1, pages + low,
+          (overlay->count - low) * sizeof(struct mmap_feature));
+  pages[low].feature_number = page_num;
+  pages[low].feature_value = delta;
+  ++overlay->count;
+}
+
+static void apply_event(struct stream_state *stream, const char *line,
+                        double now) {
+  int64_t userid;
+  int64_t page_num;
+  double delta;
+  if (sscanf(line, "%" SCNd64 " %" SCNd64 " %lf",
+             &userid, &page_num, &delta) != 3
+      || userid < 0 || page_num < 0 || page_num >= stream->num_pages
+      || !isfinite(delta)) {
+    ++stream->num_bad_events;
+    return;
+  }
+  ++stream->num_events;
+  struct user_overlay *overlay = get_overlay(stream, userid);
+  if (stream->half_life > 0.0) {
+    decay_overlay(overlay, stream->half_life, now);
+  }
+  apply_delta(overlay, page_num, delta);
+  if (overlay->first_pending == 0.0) {
+    overlay->first_pending = now;
+    if (stream->num_pending == stream->max_pending) {
+      stream->max_pending = stream->max_pending > 0
+          ? 2 * stream->max_pending : 64;
+      stream->pending = realloc(stream->pending,
+                                stream->max_pending * sizeof(int64_t));
+    }
+    stream->pending[stream->num_pending++] = overlay - stream->table;
+  }
+}
+
+int read_stream_events(struct stream_state *stream, double timeout) {
+  struct pollfd pfd;
+  pfd.fd = stream->fd;
+  pfd.events = POLLIN;
+  int timeout_ms = timeout > 0.0 ? (int)ceil(timeout * 1000.0) : 0;
+  if (poll(&pfd, 1, timeout_ms) <= 0) {
+    return 1;
+  }
+  ssize_t bytes = read(stream->fd, stream->buffer + stream->buffer_fill,
+                       STREAM_BUFFER_SIZE - 1 - stream->buffer_fill);
+  if (bytes <= 0) {
+    if (stream->buffer_fill > 0) {
+      stream->buffer[stream->buffer_fill] = '\0';
+      apply_event(stream, stream->buffer, monotonic_seconds());
+      stream->buffer_fill = 0;
+    }
+    return 0;
+  }
+  double now = monotonic_seconds();
+  stream->buffer_fill += bytes;
+  char *line = stream->buffer;
+  char *end = stream->buffer + stream->buffer_fill;
+  char *newline;
+  while ((newline = memchr(line, '\n', end - line)) != NULL) {
+    *newline = '\0';
+    if (newline > line) {
+      apply_event(stream, line, now);
+    }
+    line = newline + 1;
+  }
+  stream->buffer_fill = end - line;
+  if (stream->buffer_fill == STREAM_BUFFER_SIZE - 1) {
+    // No line is this long; discard it.
+    ++stream->num_bad_events;
+    stream->buffer_fill = 0;
+  }
+  memmove(stream->buffer, line, stream->buffer_fill);
+  return 1;
+}
+
+void flush_stream(struct stream_state *stream, emit_work_fn emit,
+                  void *context) {
+  for (int64_t i = 0; i < stream->num_pending; ++i) {
+    struct user_overlay *overlay = stream->table + stream->pending[i];
+    struct user_group *work = malloc(sizeof(struct user_group));
+    work->num_users = 1;
+    work->userids = malloc(sizeof(int64_t));
+    work->userids[0] = overlay->userid;
+    work->sequence = stream->sequence++;
+    work->next = NULL;
+    work->duplicates = NULL;
+    work->num_pages = overlay->count;
+    work->pages = malloc((overlay->count > 0 ? overlay->count : 1)
+                         * sizeof(struct mmap_feature));
+    memcpy(work->pages, overlay->pages,
+           overlay->count * sizeof(struct mmap_feature));
+    work->event_time = overlay->first_pending;
+    work->cc_bound = 0.0;
+    overlay->first_pending = 0.0;
+    ++stream->num_rescores;
+    emit(work, context);
+  }
+  stream->num_pending = 0;
+}
+
+void free_stream(struct stream_state *stream) {
+  if (stream->fd != STDIN_FILENO) {
+    close(stream->fd);
+  }
+  for (int64_t i = 0; i < stream->table_capacity; ++i) {
+    if (stream->table[i].userid != -1) {
+      free(stream->table[i].pages);
+    }
+  }
+  free(stream->table);
+  free(stream->pending);
+  free(stream->buffer);
+}
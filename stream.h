@@ -0,0 +1,83 @@
+/* Online scoring of a stream of edit events. Events are lines of
+   "userid pageid delta" read from stdin or a FIFO. Each user touched by
+   the stream gets an in-memory copy of its page vector from users_mmap
+   (the overlay), which events update. Changed users are collected and
+   handed out for rescoring once per flush interval, so a burst of
+   edits to one user costs one rescore.
+
+   With a half-life, edit weights decay exponentially with the time
+   since they arrived: when an event reaches a user, its existing
+   weights are scaled down first, and pages whose weight falls below
+   STREAM_EXPIRY_FRACTION of the user's total drop out of the
+   window. Weights in users_mmap count as arriving when the stream
+   starts. */
+
+#ifndef __stream_h__
+#define __stream_h__
+
+#include <stdint.h>
+
+#include "score_thread.h"
+
+struct mmap_item;
+struct mmap_feature;
+
+#define STREAM_EXPIRY_FRACTION 1e-4
+
+struct user_overlay {
+  /* -1 for an empty hash table slot. */
+  int64_t userid;
+  /* Sorted by page number; values are positive. */
+  struct mmap_feature *pages;
+  int64_t count;
+  int64_t capacity;
+  /* When the weights were last decayed. */
+  double last_update;
+  /* Arrival of the oldest event not yet rescored, or 0 if none. */
+  double first_pending;
+};
+
+struct stream_state {
+  int fd;
+  const char *mmap_users;
+  const struct mmap_item *users;
+  int64_t num_users;
+  /* Events for pages at or beyond this are rejected. */
+  int64_t num_pages;
+  /* Seconds; 0 disables decay. */
+  double half_life;
+  double start_time;
+  /* Open addressing hash table keyed by userid. */
+  struct user_overlay *table;
+  int64_t table_capacity;
+  int64_t table_size;
+  /* Overlay slots with pending events. */
+  int64_t *pending;
+  int64_t num_pending;
+  int64_t max_pending;
+  /* Partial input line. */
+  char *buffer;
+  int64_t buffer_fill;
+  int64_t num_events;
+  int64_t num_bad_events;
+  int64_t num_rescores;
+  int64_t sequence;
+};
+
+/* Read events from file_name, or stdin if it is "-". */
+void init_stream(struct stream_state *stream, const char *file_name,
+                 const char *mmap_users, const struct mmap_item *users,
+                 int64_t num_users, int64_t num_pages, double half_life);
+/* Apply the events that arrive within timeout seconds. Returns 0 once
+   the stream has ended. */
+int read_stream_events(struct stream_state *stream, double timeout);
+/* Emit a single-user work item, carrying a snapshot of the user's
+   vector, for every user with pending events. */
+void flush_stream(struct stream_state *stream, emit_work_fn emit,
+                  void *context);
+void free_stream(struct stream_state *stream);
+
+/* Seconds on the monotonic clock. */
+double monotonic_seconds(void);
+
+#endif
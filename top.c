@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "top.h"
+#include "read_mmap.h"
+#include "score_thread.h"
+
+void init_top_results(struct top_results *top, int capacity) {
+  assert(capacity > 0);
+  pthread_mutex_init(&top->lock, NULL);
+  top->capacity = capacity;
+  top->size = 0;
+  top->entries = malloc(capacity * sizeof(struct top_entry));
+  top->num_offered = 0;
+}
+
+/* Ties are broken by input position so results do not depend on
+   thread timing. */
+static int better(const struct top_entry *a, const struct top_entry *b) {
+  if (a->score != b->score) {
+    return a->score > b->score;
+  }
+  return a->sequence < b->sequence;
+}
+
+static void swap_entries(struct top_entry *a, struct top_entry *b) {
+  struct top_entry tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void sift_down(struct top_entry *heap, int size, int i) {
+  while (1) {
+    int worst = i;
+    int left = 2 * i + 1;
+    int right = left + 1;
+    if (left < size && better(heap + worst, heap + left)) {
+      worst = left;
+    }
+    if (right < size && better(heap + worst, heap + right)) {
+      worst = right;
+    }
+    if (worst == i) {
+      return;
+    }
+    swap_entries(heap + i, heap + worst);
+    i = worst;
+  }
+}
+
+static void sift_up(struct top_entry *heap, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!better(heap + parent, heap + i)) {
+      return;
+    }
+    swap_entries(heap + i, heap + parent);
+    i = parent;
+  }
+}
+
+int top_threshold(struct top_results *top, double *threshold) {
+  pthread_mutex_lock(&top->lock);
+  int full = top->size == top->capacity;
+  if (full) {
+    *threshold = top->entries[0].score;
+  }
+  pthread_mutex_unlock(&top->lock);
+  return full;
+}
+
+int top_can_enter(struct top_results *top, double bound) {
+  double threshold;
+  return !top_threshold(top, &threshold) || bound >= threshold;
+}
+
+void offer_top_result(struct top_results *top, double score,
+                      int64_t sequence, char *scores_line,
+                      char *page_stats_line) {
+  struct top_entry entry;
+  entry.score = score;
+  entry.sequence = sequence;
+  entry.scores_line = scores_line;
+  entry.page_stats_line = page_stats_line;
+  // Whichever result does not make the cut; none while filling up.
+  struct top_entry dropped = entry;
+  pthread_mutex_lock(&top->lock);
+  ++top->num_offered;
+  if (top->size < top->capacity) {
+    top->entries[top->size] = entry;
+    sift_up(top->entries, top->size);
+    ++top->size;
+    dropped.scores_line = NULL;
+    dropped.page_stats_line = NULL;
+  } else if (better(&entry, top->entries)) {
+    dropped = top->entries[0];
+    top->entries[0] = entry;
+    sift_down(top->entries, top->size, 0);
+  }
+  pthread_mutex_unlock(&top->lock);
+  free(dropped.scores_line);
+  free(dropped.page_stats_line);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const struct top_entry *first = a;
+  const struct top_entry *second = b;
+  if (better(first, second)) {
+    return -1;
+  }
+  return better(second, first) ? 1 : 0;
+}
+
+void write_top_results(struct top_results *top, FILE *scores_out,
+                       FILE *page_stats_out) {
+  qsort(top->entries, top->size, sizeof(struct top_entry), compare_entries);
+  for (int i = 0; i < top->size; ++i) {
+    fputs(top->entries[i].scores_line, scores_out);
+    fputs(top->entries[i].page_stats_line, page_stats_out);
+  }
+}
+
+void free_top_results(struct top_results *top) {
+  for (int i = 0; i < top->size; ++i) {
+    free(top->entries[i].scores_line);
+    free(top->entries[i].page_stats_line);
+  }
+  free(top->entries);
+  pthread_mutex_destroy(&top->lock);
+}
+
+double cc_upper_bound(const struct user_group *work, const char *mmap_users,
+                      const struct mmap_item *users, int64_t num_users,
+                      const struct mmap_feature *controversy,
+                      int64_t num_controversy) {
+  // A group's edit fractions are its members' summed edits over the
+  // members' summed totals, so the pages need not be merged.
+  double weighted = 0.0;
+  double total = 0.0;
+  for (int i = 0; i < work->num_users; ++i) {
+    // Out-of-range ids are left for the worker to reject.
+    if (work->userids[i] < 0 || work->userids[i] >= num_users) {
+      continue;
+    }
+    const struct mmap_item *user = users + work->userids[i];
+    const struct mmap_feature *user_pages = get_features(mmap_users, user);
+    if (user_pages == NULL) {
+      continue;
+    }
+    for (int64_t j = 0; j < user->count_features; ++j) {
+      int64_t page_num = user_pages[j].feature_number;
+      if (page_num < num_controversy
+          && controversy[page_num].feature_value > 0.0) {
+        weighted += user_pages[j].feature_value
+            * controversy[page_num].feature_value;
+      }
+    }
+    total += user->sum_or_norm;
+  }
+  return total > 0.0 ? weighted / total : 0.0;
+}
@@ -0,0 +1,64 @@
+/* Top-N search by CC score. Every edge weight (page similarity) is at
+   most one, so each page's clustering score is at most one and a work
+   item's CC is bounded by its edit-weighted controversy sum, which
+   takes O(pages) to compute. Items are scored in descending order of
+   this bound into a shared min-heap of the best N results, and the
+   search stops once no remaining bound can beat the heap's minimum.
+   Workers check an item's bound again just before scoring it, since
+   the minimum may have risen while the item was queued. */
+
+#ifndef __top_h__
+#define __top_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct user_group;
+struct mmap_item;
+struct mmap_feature;
+
+struct top_entry {
+  double score;
+  int64_t sequence;
+  /* The item's output lines, as written to scores_out_X and
+     raw_page_stats_out_X. */
+  char *scores_line;
+  char *page_stats_line;
+};
+
+struct top_results {
+  pthread_mutex_t lock;
+  int capacity;
+  int size;
+  /* Min-heap: the worst kept result is entries[0]. */
+  struct top_entry *entries;
+  int64_t num_offered;
+};
+
+void init_top_results(struct top_results *top, int capacity);
+/* Returns 1 and sets threshold to the lowest kept score if the results
+   are full, so that only items scoring above it can still enter. */
+int top_threshold(struct top_results *top, double *threshold);
+/* Whether an item whose CC is at most bound could still enter the
+   results. */
+int top_can_enter(struct top_results *top, double bound);
+/* Offer a scored item. The results take ownership of the lines, which
+   are freed if the item does not make the cut. */
+void offer_top_result(struct top_results *top, double score,
+                      int64_t sequence, char *scores_line,
+                      char *page_stats_line);
+/* Write the kept results, best first. */
+void write_top_results(struct top_results *top, FILE *scores_out,
+                       FILE *page_stats_out);
+void free_top_results(struct top_results *top);
+
+/* Upper bound on the CC score of a work item: the sum over its pages of
+   edit fraction times (non-negative) controversy. Userids outside
+   users are skipped. */
+double cc_upper_bound(const struct user_group *work, const char *mmap_users,
+                      const struct mmap_item *users, int64_t num_users,
+                      const struct mmap_feature *controversy,
+                      int64_t num_controversy);
+
+#endif